@@ -3,329 +3,779 @@
 
 extern DS_ALLOCATOR allocator;
 
-static void chess_valid_moves(const chess_state_t *state, square_t start, ds_dynamic_array *moves /* move_t */, boolean validate);
+#define BB_FILE_A 0x0101010101010101ULL
+#define BB_FILE_B (BB_FILE_A << 1)
+#define BB_FILE_G (BB_FILE_A << 6)
+#define BB_FILE_H (BB_FILE_A << 7)
 
-static boolean chess_can_apply_move(const chess_state_t *state, move_t move) {
-    chess_state_t clone = {0};
-    DS_MEMCPY(&clone, state, sizeof(chess_state_t));
+#define CHESS_GENERATE_CAPTURES 1 // Captures, en passant and promotions
+#define CHESS_GENERATE_QUIETS 2 // Every other move, castling included
 
-    chess_apply_move(&clone, move);
-    if (chess_is_in_check(&clone, clone.current_player)) {
-        return false;
-    }
+static int bitboard_count(bitboard_t bb) {
+    return __builtin_popcountll(bb);
+}
 
-    return true;
+static int bitboard_lsb(bitboard_t bb) {
+    return __builtin_ctzll(bb);
+}
+
+static int bitboard_pop_lsb(bitboard_t *bb) {
+    int index = bitboard_lsb(*bb);
+    *bb &= *bb - 1;
+    return index;
+}
+
+static bitboard_t chess_knight_attacks(bitboard_t bb) {
+    bitboard_t l1 = (bb >> 1) & ~BB_FILE_H;
+    bitboard_t l2 = (bb >> 2) & ~(BB_FILE_G | BB_FILE_H);
+    bitboard_t r1 = (bb << 1) & ~BB_FILE_A;
+    bitboard_t r2 = (bb << 2) & ~(BB_FILE_A | BB_FILE_B);
+    bitboard_t h1 = l1 | r1;
+    bitboard_t h2 = l2 | r2;
+
+    return (h1 << 16) | (h1 >> 16) | (h2 << 8) | (h2 >> 8);
 }
 
-static boolean chess_validate_move(const chess_state_t *state, move_t move, boolean validate) {
-    return (validate == true && chess_can_apply_move(state, move) == true) || (validate == false);
+static bitboard_t chess_king_attacks(bitboard_t bb) {
+    bitboard_t sides = ((bb >> 1) & ~BB_FILE_H) | ((bb << 1) & ~BB_FILE_A);
+    bitboard_t row = bb | sides;
+
+    return sides | (row << 8) | (row >> 8);
 }
 
-static void chess_valid_moves_pawn(const chess_state_t *state, square_t start, char piece_color, ds_dynamic_array *moves /* move_t */, boolean validate) {
-    char piece = 0;
-    int forward_direction = (piece_color == CHESS_WHITE) ? 1 : -1;
-    int second_rank = (piece_color == CHESS_WHITE) ? 1 : 6;
-    int promotion_rank = (piece_color == CHESS_WHITE) ? 7 : 0;
+typedef struct chess_magic_t {
+    bitboard_t mask; // Relevant occupancy, the ray squares without the board edge
+    bitboard_t magic;
+    bitboard_t *attacks;
+    int shift;
+} chess_magic_t;
+
+static const bitboard_t chess_rook_magic_numbers[CHESS_WIDTH * CHESS_HEIGHT] = {
+    0x1080004008801020ULL, 0x0840092002c03000ULL, 0x1900200010400900ULL, 0x0880100008000480ULL,
+    0x4200100420080200ULL, 0x8100020100080400ULL, 0x0200040110886200ULL, 0x0200008040220411ULL,
+    0x0404800084400220ULL, 0x0000401000402000ULL, 0x0086001081220440ULL, 0x0408800800100280ULL,
+    0x000a001201040820ULL, 0x8848800200840080ULL, 0x4001000100040200ULL, 0x0442000102105084ULL,
+    0x9080010020804100ULL, 0x0040404000201009ULL, 0x0000808010002009ULL, 0x2200090021d00100ULL,
+    0x0008008008040080ULL, 0x0004004002010040ULL, 0x0011040008015042ULL, 0x00000a0001768104ULL,
+    0x0000800080204009ULL, 0x2010004140002001ULL, 0x9800200280100080ULL, 0x1000100080080080ULL,
+    0x0442000a00049020ULL, 0x2100040080020080ULL, 0x0800120400900148ULL, 0x0010040a00128541ULL,
+    0x2800804000800030ULL, 0x1010002000400041ULL, 0x4000200011004100ULL, 0x0610008410800800ULL,
+    0x0400802402800800ULL, 0xc100020080800400ULL, 0x0002000802000401ULL, 0x0182085882000401ULL,
+    0x0220204000808000ULL, 0x2860100040024022ULL, 0x0001002004110040ULL, 0x99101042000a0020ULL,
+    0x0004080004008080ULL, 0x0010040002008080ULL, 0x2012004881020004ULL, 0x8300842444820011ULL,
+    0x0088403882010200ULL, 0x0820400080210100ULL, 0x0110910040a00300ULL, 0x0801100280080480ULL,
+    0x0242009008200600ULL, 0x1002000489500200ULL, 0x0040800200010080ULL, 0x0091800041000080ULL,
+    0x0000209300488001ULL, 0x04c1002414824001ULL, 0x020020000b001041ULL, 0x7000100004200901ULL,
+    0x8002002004100802ULL, 0x30010002084c0007ULL, 0x0888221800813004ULL, 0x4000002840840112ULL,
+};
 
-    square_t forward = { .file = start.file, .rank = start.rank + forward_direction };
-    if (chess_square_get(&state->board, forward) == CHESS_NONE && chess_validate_move(state, MK_MOVE(start, forward, CHESS_MOVE, CHESS_NONE), validate)) {
-        char move = CHESS_MOVE;
-        if (forward.rank == promotion_rank) {
-            move |= CHESS_PROMOTE;
-            for (int i = 0; i < 4; i++) {
-                char promote = CHESS_PROMOTE_OPTIONS[i] | piece_color;
-                DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, forward, move, promote)));
+static const bitboard_t chess_bishop_magic_numbers[CHESS_WIDTH * CHESS_HEIGHT] = {
+    0xa010041108003100ULL, 0x006082020a002900ULL, 0x6810010619200000ULL, 0x08281a0520000408ULL,
+    0x0001104001000400ULL, 0x0018901008048400ULL, 0x00040a0210245280ULL, 0x000200210808a402ULL,
+    0x9140048410821200ULL, 0x0800091010820041ULL, 0x20504804832202c0ULL, 0x0100091401081000ULL,
+    0x8021011140000012ULL, 0x0810020804450400ULL, 0x208b0542109008a2ULL, 0x0080084a08040204ULL,
+    0x0040e2a80811244cULL, 0x2505022008008108ULL, 0x0430220100420040ULL, 0x010a040420220040ULL,
+    0x1105000290400000ULL, 0x0093001200822120ULL, 0x4000a62048043004ULL, 0x280120048a015004ULL,
+    0x006090002a020814ULL, 0x44042000240800d0ULL, 0x01102800040a4400ULL, 0x1004080080220040ULL,
+    0x0001001011004024ULL, 0x0010044000805040ULL, 0x0914041200820100ULL, 0x0004821012821480ULL,
+    0x0024040500c05021ULL, 0x0088611002080200ULL, 0x0116080a00040020ULL, 0x4000020080080080ULL,
+    0x2450450140840040ULL, 0x0000880201484100ULL, 0x0222020404020092ULL, 0x8081110600002e00ULL,
+    0x2842101105000801ULL, 0x1100809008001025ULL, 0x00020202221c0400ULL, 0x0422014022009020ULL,
+    0x0210046102100c00ULL, 0xc004008082029102ULL, 0x00aa461801101200ULL, 0x0404080080201108ULL,
+    0x020542108c205002ULL, 0x0410544804100100ULL, 0x0040910841100000ULL, 0x0400200042021100ULL,
+    0x00004204850400c0ULL, 0x0200100410a42102ULL, 0x1040020801210102ULL, 0x0805040410420000ULL,
+    0x2884804130100200ULL, 0x800c262201242000ULL, 0x1058000194108800ULL, 0x0014221054420204ULL,
+    0x0104000012a02200ULL, 0x0200881003300100ULL, 0x0140400202840100ULL, 0x0402020801010201ULL,
+};
+
+static const int chess_rook_rank_diffs[] = {1, -1, 0, 0};
+static const int chess_rook_file_diffs[] = {0, 0, 1, -1};
+static const int chess_bishop_rank_diffs[] = {1, 1, -1, -1};
+static const int chess_bishop_file_diffs[] = {1, -1, 1, -1};
+
+static bitboard_t chess_rook_attack_table[102400];
+static bitboard_t chess_bishop_attack_table[5248];
+static chess_magic_t chess_rook_magics[CHESS_WIDTH * CHESS_HEIGHT];
+static chess_magic_t chess_bishop_magics[CHESS_WIDTH * CHESS_HEIGHT];
+static bitboard_t chess_between_table[CHESS_WIDTH * CHESS_HEIGHT][CHESS_WIDTH * CHESS_HEIGHT];
+static bitboard_t chess_line_table[CHESS_WIDTH * CHESS_HEIGHT][CHESS_WIDTH * CHESS_HEIGHT];
+static bitboard_t chess_knight_table[CHESS_WIDTH * CHESS_HEIGHT];
+static bitboard_t chess_king_table[CHESS_WIDTH * CHESS_HEIGHT];
+static bitboard_t chess_pawn_table[2][CHESS_WIDTH * CHESS_HEIGHT]; // Capture targets, indexed by COLOR_INDEX
+static zobrist_t chess_zobrist_pieces[2][7][CHESS_WIDTH * CHESS_HEIGHT];
+static zobrist_t chess_zobrist_castling[16];
+static zobrist_t chess_zobrist_enpassant[CHESS_WIDTH];
+static zobrist_t chess_zobrist_side;
+static char chess_castling_table[CHESS_WIDTH * CHESS_HEIGHT]; // Rights kept when a move starts or ends on the square
+static boolean chess_tables_ready = false;
+
+// Walk the 4 rays from index until a blocker, used only to fill the tables
+static bitboard_t chess_ray_attacks(int index, bitboard_t occupied, const int *rank_diffs, const int *file_diffs, boolean relevant) {
+    bitboard_t attacks = 0;
+    square_t start = MK_SQUARE_INDEX(index);
+
+    for (unsigned int i = 0; i < 4; i++) {
+        for (int j = 1; j < CHESS_WIDTH; j++) {
+            square_t target = { .file = start.file + j * file_diffs[i], .rank = start.rank + j * rank_diffs[i] };
+            if (target.file < 0 || target.file >= CHESS_WIDTH || target.rank < 0 || target.rank >= CHESS_HEIGHT) {
+                break;
             }
-        } else {
-            DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, forward, move, CHESS_NONE)));
-        }
-    }
 
-    square_t forward_left = { .file = start.file - 1, .rank = start.rank + forward_direction };
-    piece = chess_square_get(&state->board, forward_left);
-    if (forward_left.file >= 0 && (piece & COLOR_FLAG) != piece_color && (piece & PIECE_FLAG) != CHESS_NONE && chess_validate_move(state, MK_MOVE(start, forward_left, CHESS_MOVE | CHESS_CAPTURE, CHESS_NONE), validate)) {
-        char move = CHESS_MOVE | CHESS_CAPTURE;
-        if (forward_left.rank == promotion_rank) {
-            move |= CHESS_PROMOTE;
-            for (int i = 0; i < 4; i++) {
-                char promote = CHESS_PROMOTE_OPTIONS[i] | piece_color;
-                DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, forward_left, move, promote)));
+            square_t next = { .file = target.file + file_diffs[i], .rank = target.rank + rank_diffs[i] };
+            if (relevant && (next.file < 0 || next.file >= CHESS_WIDTH || next.rank < 0 || next.rank >= CHESS_HEIGHT)) {
+                break;
             }
-        } else {
-            DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, forward_left, move, CHESS_NONE)));
-        }
-    }
 
-    square_t forward_right = { .file = start.file + 1, .rank = start.rank + forward_direction };
-    piece = chess_square_get(&state->board, forward_right);
-    if (forward_right.file < CHESS_WIDTH && (piece & COLOR_FLAG) != piece_color && (piece & PIECE_FLAG) != CHESS_NONE && chess_validate_move(state, MK_MOVE(start, forward_right, CHESS_MOVE | CHESS_CAPTURE, CHESS_NONE), validate)) {
-        char move = CHESS_MOVE | CHESS_CAPTURE;
-        if (forward_right.rank == promotion_rank) {
-            move |= CHESS_PROMOTE;
-            for (int i = 0; i < 4; i++) {
-                char promote = CHESS_PROMOTE_OPTIONS[i] | piece_color;
-                DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, forward_right, move, promote)));
+            attacks |= BB_SQUARE(SQUARE_INDEX(target));
+            if ((occupied & BB_SQUARE(SQUARE_INDEX(target))) != 0) {
+                break;
             }
-        } else {
-            DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, forward_right, move, CHESS_NONE)));
         }
     }
 
-    square_t forward2 = { .file = start.file, .rank = start.rank + 2 * forward_direction };
-    if (chess_square_get(&state->board, forward) == CHESS_NONE && chess_square_get(&state->board, forward2) == CHESS_NONE && start.rank == second_rank && chess_validate_move(state, MK_MOVE(start, forward2, CHESS_MOVE, CHESS_NONE), validate)) {
-        DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, forward2, CHESS_MOVE, CHESS_NONE)));
-    }
+    return attacks;
+}
 
-    if (state->last_move) {
-        char piece = chess_square_get(&state->board, state->last_move_end);
-        int is_pawn = (piece & PIECE_FLAG) == CHESS_PAWN;
-        int has_pushed2 = DS_ABS(state->last_move_end.rank - state->last_move_start.rank) == 2;
-        int diff = state->last_move_end.file - start.file;
-        int is_neighbor = DS_ABS(diff) == 1;
-        int same_rank = start.rank == state->last_move_end.rank;
-        int can_enp = is_pawn && has_pushed2 && is_neighbor && same_rank;
+static unsigned int chess_magic_index(const chess_magic_t *magic, bitboard_t occupied) {
+    return ((occupied & magic->mask) * magic->magic) >> magic->shift;
+}
 
-        square_t forward_enp = { .file = start.file + diff, .rank = start.rank + forward_direction };
-        if (can_enp && chess_validate_move(state, MK_MOVE(start, forward_enp, CHESS_MOVE | CHESS_ENPASSANT | CHESS_CAPTURE, CHESS_NONE), validate)) {
-            DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, forward_enp, CHESS_MOVE | CHESS_ENPASSANT | CHESS_CAPTURE, CHESS_NONE)));
-        }
+static void chess_init_magics(chess_magic_t *magics, const bitboard_t *numbers, bitboard_t *table, const int *rank_diffs, const int *file_diffs) {
+    bitboard_t *attacks = table;
+
+    for (int index = 0; index < CHESS_WIDTH * CHESS_HEIGHT; index++) {
+        chess_magic_t *magic = &magics[index];
+        magic->mask = chess_ray_attacks(index, 0, rank_diffs, file_diffs, true);
+        magic->magic = numbers[index];
+        magic->shift = 64 - bitboard_count(magic->mask);
+        magic->attacks = attacks;
+
+        // Enumerate every subset of the mask (Carry-Rippler)
+        bitboard_t occupied = 0;
+        do {
+            magic->attacks[chess_magic_index(magic, occupied)] = chess_ray_attacks(index, occupied, rank_diffs, file_diffs, false);
+            occupied = (occupied - magic->mask) & magic->mask;
+        } while (occupied != 0);
+
+        attacks += 1ULL << bitboard_count(magic->mask);
     }
 }
 
-static void chess_valid_moves_knight(const chess_state_t *state, square_t start, char piece_color, ds_dynamic_array *moves /* move_t */, boolean validate) {
-    int rank_diffs[] = {2, 2, 1, -1, -2, -2, -1, 1};
-    int file_diffs[] = {-1, 1, 2, 2, 1, -1, -2, -2};
+static bitboard_t chess_rook_attacks(int index, bitboard_t occupied) {
+    const chess_magic_t *magic = &chess_rook_magics[index];
+    return magic->attacks[chess_magic_index(magic, occupied)];
+}
 
-    for (unsigned int i = 0; i < 8; i++) {
-        int rank_diff = rank_diffs[i];
-        int file_diff = file_diffs[i];
+static bitboard_t chess_bishop_attacks(int index, bitboard_t occupied) {
+    const chess_magic_t *magic = &chess_bishop_magics[index];
+    return magic->attacks[chess_magic_index(magic, occupied)];
+}
 
-        square_t target = { .file = start.file + file_diff, .rank = start.rank + rank_diff };
-        int is_bounded = (target.file >= 0 && target.file < CHESS_WIDTH && target.rank >= 0 && target.rank < CHESS_HEIGHT);
-        int is_free = chess_square_get(&state->board, target) == CHESS_NONE;
-        int is_capture = (chess_square_get(&state->board, target) & COLOR_FLAG) != piece_color;
+static bitboard_t chess_pawn_attacks(bitboard_t bb, char color) {
+    bitboard_t sides = ((bb >> 1) & ~BB_FILE_H) | ((bb << 1) & ~BB_FILE_A);
 
-        if (is_bounded && is_free) {
-            if (chess_validate_move(state, MK_MOVE(start, target, CHESS_MOVE, CHESS_NONE), validate)) {
-                DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, target, CHESS_MOVE, CHESS_NONE)));
-            }
-        } else if (is_bounded && is_capture) {
-            if (chess_validate_move(state, MK_MOVE(start, target, CHESS_MOVE | CHESS_CAPTURE, CHESS_NONE), validate)) {
-                DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, target, CHESS_MOVE | CHESS_CAPTURE, CHESS_NONE)));
-            }
-        }
-    }
+    return (color == CHESS_WHITE) ? sides << 8 : sides >> 8;
 }
 
-static void chess_valid_moves_bishop(const chess_state_t *state, square_t start, char piece_color, ds_dynamic_array *moves /* move_t */, boolean validate) {
-    int rank_diffs[] = {1, 1, -1, -1};
-    int file_diffs[] = {1, -1, 1, -1};
+// All the pieces, of both colors, that attack the square at index
+static bitboard_t chess_attackers(const chess_state_t *state, int index, bitboard_t occupied) {
+    bitboard_t diagonal = state->pieces[CHESS_BISHOP] | state->pieces[CHESS_QUEEN];
+    bitboard_t straight = state->pieces[CHESS_ROOK] | state->pieces[CHESS_QUEEN];
+
+    // Attacks are symmetric, so look from the target square towards the attackers
+    return (chess_pawn_table[COLOR_INDEX(CHESS_BLACK)][index] & state->pieces[CHESS_PAWN] & state->colors[COLOR_INDEX(CHESS_WHITE)]) |
+           (chess_pawn_table[COLOR_INDEX(CHESS_WHITE)][index] & state->pieces[CHESS_PAWN] & state->colors[COLOR_INDEX(CHESS_BLACK)]) |
+           (chess_knight_table[index] & state->pieces[CHESS_KNIGHT]) |
+           (chess_king_table[index] & state->pieces[CHESS_KING]) |
+           (chess_bishop_attacks(index, occupied) & diagonal) |
+           (chess_rook_attacks(index, occupied) & straight);
+}
 
-    for (unsigned int i = 0; i < 4; i++) {
-        int rank_diff = rank_diffs[i];
-        int file_diff = file_diffs[i];
+// The pieces of a single color that attack the square at index
+#define CHESS_DEFINE_ATTACKERS(suffix, COLOR)                                                                  \
+    static bitboard_t chess_attackers_##suffix(const chess_state_t *state, int index, bitboard_t occupied) {   \
+        bitboard_t diagonal = state->pieces[CHESS_BISHOP] | state->pieces[CHESS_QUEEN];                        \
+        bitboard_t straight = state->pieces[CHESS_ROOK] | state->pieces[CHESS_QUEEN];                          \
+                                                                                                               \
+        return ((chess_pawn_table[COLOR_INDEX(chess_flip_player(COLOR))][index] & state->pieces[CHESS_PAWN]) | \
+                (chess_knight_table[index] & state->pieces[CHESS_KNIGHT]) |                                    \
+                (chess_king_table[index] & state->pieces[CHESS_KING]) |                                        \
+                (chess_bishop_attacks(index, occupied) & diagonal) |                                           \
+                (chess_rook_attacks(index, occupied) & straight)) & state->colors[COLOR_INDEX(COLOR)];         \
+    }
 
-        for (unsigned int j = 1; j < CHESS_WIDTH; j++) {
-            square_t target = { .file = start.file + j * file_diff, .rank = start.rank + j * rank_diff };
-            if (target.file < 0 || target.file >= CHESS_WIDTH || target.rank < 0 || target.rank >= CHESS_HEIGHT) {
-                break;
-            }
+CHESS_DEFINE_ATTACKERS(white, CHESS_WHITE)
+CHESS_DEFINE_ATTACKERS(black, CHESS_BLACK)
 
-            char piece = chess_square_get(&state->board, target);
-            if (piece == CHESS_NONE) {
-                if (chess_validate_move(state, MK_MOVE(start, target, CHESS_MOVE, CHESS_NONE), validate)) {
-                    DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, target, CHESS_MOVE, CHESS_NONE)));
-                }
-            } else if ((piece & COLOR_FLAG) != piece_color) {
-                if (chess_validate_move(state, MK_MOVE(start, target, CHESS_MOVE | CHESS_CAPTURE, CHESS_NONE), validate)) {
-                    DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, target, CHESS_MOVE | CHESS_CAPTURE, CHESS_NONE)));
-                }
-                break;
-            } else {
-                break;
+// splitmix64, so that the keys are the same on every run and platform
+static zobrist_t chess_zobrist_next(zobrist_t *seed) {
+    zobrist_t z = (*seed += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void chess_init_zobrist(void) {
+    zobrist_t seed = 0x636865737321ULL;
+
+    for (int color = 0; color < 2; color++) {
+        for (int type = 0; type < 7; type++) {
+            for (int index = 0; index < CHESS_WIDTH * CHESS_HEIGHT; index++) {
+                chess_zobrist_pieces[color][type][index] = chess_zobrist_next(&seed);
             }
         }
     }
+
+    for (int i = 0; i < 16; i++) {
+        chess_zobrist_castling[i] = chess_zobrist_next(&seed);
+    }
+
+    for (int i = 0; i < CHESS_WIDTH; i++) {
+        chess_zobrist_enpassant[i] = chess_zobrist_next(&seed);
+    }
+
+    chess_zobrist_side = chess_zobrist_next(&seed);
 }
 
-static void chess_valid_moves_rook(const chess_state_t *state, square_t start, char piece_color, ds_dynamic_array *moves /* move_t */, boolean validate) {
-    int rank_diffs[] = {1, -1, 0, 0};
-    int file_diffs[] = {0, 0, 1, -1};
+// Everything in the key except the pieces, which chess_piece_put and chess_piece_remove keep up to date
+static zobrist_t chess_zobrist_extra(const chess_state_t *state) {
+    zobrist_t hash = chess_zobrist_castling[(int)state->castling];
 
-    for (unsigned int i = 0; i < 4; i++) {
-        int rank_diff = rank_diffs[i];
-        int file_diff = file_diffs[i];
+    if (state->enpassant >= 0) {
+        hash ^= chess_zobrist_enpassant[state->enpassant % CHESS_WIDTH];
+    }
 
-        for (unsigned int j = 1; j < CHESS_WIDTH; j++) {
-            square_t target = { .file = start.file + j * file_diff, .rank = start.rank + j * rank_diff };
-            if (target.file < 0 || target.file >= CHESS_WIDTH || target.rank < 0 || target.rank >= CHESS_HEIGHT) {
-                break;
-            }
+    return hash;
+}
 
-            char piece = chess_square_get(&state->board, target);
-            if (piece == CHESS_NONE) {
-                if (chess_validate_move(state, MK_MOVE(start, target, CHESS_MOVE, CHESS_NONE), validate)) {
-                    DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, target, CHESS_MOVE, CHESS_NONE)));
-                }
-            } else if ((piece & COLOR_FLAG) != piece_color) {
-                if (chess_validate_move(state, MK_MOVE(start, target, CHESS_MOVE | CHESS_CAPTURE, CHESS_NONE), validate)) {
-                    DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, target, CHESS_MOVE | CHESS_CAPTURE, CHESS_NONE)));
-                }
-                break;
-            } else {
-                break;
-            }
-        }
+static zobrist_t chess_zobrist_piece(char piece, int index) {
+    return chess_zobrist_pieces[COLOR_INDEX(piece & COLOR_FLAG)][piece & PIECE_FLAG][index];
+}
+
+static void chess_piece_put(chess_state_t *state, int index, char piece) {
+    bitboard_t bb = BB_SQUARE(index);
+
+    state->hash ^= chess_zobrist_piece(piece, index);
+    state->board[index] = piece;
+    state->pieces[piece & PIECE_FLAG] |= bb;
+    state->colors[COLOR_INDEX(piece & COLOR_FLAG)] |= bb;
+}
+
+static char chess_piece_remove(chess_state_t *state, int index) {
+    bitboard_t bb = BB_SQUARE(index);
+    char piece = state->board[index];
+
+    if (piece != CHESS_NONE) {
+        state->hash ^= chess_zobrist_piece(piece, index);
+        state->board[index] = CHESS_NONE;
+        state->pieces[piece & PIECE_FLAG] &= ~bb;
+        state->colors[COLOR_INDEX(piece & COLOR_FLAG)] &= ~bb;
     }
+
+    return piece;
 }
 
-static void chess_valid_moves_queen(const chess_state_t *state, square_t start, char piece_color, ds_dynamic_array *moves /* move_t */, boolean validate) {
-    int rank_diffs[] = {1, 1, -1, -1, 1, -1, 0, 0};
-    int file_diffs[] = {1, -1, 1, -1, 0, 0, 1, -1};
+// Every square attacked by the pieces of color, sliders stop at the occupied squares
+static bitboard_t chess_attacks(const chess_state_t *state, char color, bitboard_t occupied) {
+    bitboard_t own = state->colors[COLOR_INDEX(color)];
+    bitboard_t attacks =
+        chess_pawn_attacks(state->pieces[CHESS_PAWN] & own, color) |
+        chess_knight_attacks(state->pieces[CHESS_KNIGHT] & own) |
+        chess_king_attacks(state->pieces[CHESS_KING] & own);
+
+    bitboard_t diagonal = (state->pieces[CHESS_BISHOP] | state->pieces[CHESS_QUEEN]) & own;
+    while (diagonal != 0) {
+        attacks |= chess_bishop_attacks(bitboard_pop_lsb(&diagonal), occupied);
+    }
 
-    for (unsigned int i = 0; i < 8; i++) {
-        int rank_diff = rank_diffs[i];
-        int file_diff = file_diffs[i];
+    bitboard_t straight = (state->pieces[CHESS_ROOK] | state->pieces[CHESS_QUEEN]) & own;
+    while (straight != 0) {
+        attacks |= chess_rook_attacks(bitboard_pop_lsb(&straight), occupied);
+    }
 
-        for (unsigned int j = 1; j < CHESS_WIDTH; j++) {
-            square_t target = { .file = start.file + j * file_diff, .rank = start.rank + j * rank_diff };
-            if (target.file < 0 || target.file >= CHESS_WIDTH || target.rank < 0 || target.rank >= CHESS_HEIGHT) {
-                break;
-            }
+    return attacks;
+}
 
-            char piece = chess_square_get(&state->board, target);
-            if (piece == CHESS_NONE) {
-                if (chess_validate_move(state, MK_MOVE(start, target, CHESS_MOVE, CHESS_NONE), validate)) {
-                    DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, target, CHESS_MOVE, CHESS_NONE)));
-                }
-            } else if ((piece & COLOR_FLAG) != piece_color) {
-                if (chess_validate_move(state, MK_MOVE(start, target, CHESS_MOVE | CHESS_CAPTURE, CHESS_NONE), validate)) {
-                    DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, target, CHESS_MOVE | CHESS_CAPTURE, CHESS_NONE)));
-                }
-                break;
-            } else {
-                break;
-            }
+void chess_attack_map_compute(const chess_state_t *state, chess_attack_map_t *map) {
+    char current = state->current_player;
+    bitboard_t own = state->colors[COLOR_INDEX(current)];
+    bitboard_t enemy = state->colors[COLOR_INDEX(chess_flip_player(current))];
+    bitboard_t occupied = own | enemy;
+
+    map->hash = state->hash;
+    map->player = current;
+    map->king = state->king_square[COLOR_INDEX(current)];
+    if (map->king < 0) {
+        DS_PANIC("King not found");
+    }
+
+    // Without our king on the board, so that it cannot step back along a check ray
+    map->threats = chess_attacks(state, chess_flip_player(current), occupied & ~BB_SQUARE(map->king));
+    map->checkers = chess_attackers(state, map->king, occupied) & enemy;
+    map->pinned = 0;
+
+    // Enemy sliders that would see the king on an empty board pin exactly one piece in between
+    bitboard_t snipers =
+        ((chess_bishop_attacks(map->king, 0) & (state->pieces[CHESS_BISHOP] | state->pieces[CHESS_QUEEN])) |
+         (chess_rook_attacks(map->king, 0) & (state->pieces[CHESS_ROOK] | state->pieces[CHESS_QUEEN]))) & enemy;
+    while (snipers != 0) {
+        int sniper = bitboard_pop_lsb(&snipers);
+        bitboard_t blockers = chess_between_table[map->king][sniper] & occupied;
+        if (bitboard_count(blockers) == 1 && (blockers & own) != 0) {
+            map->pinned |= blockers;
         }
     }
+
+    switch (bitboard_count(map->checkers)) {
+        case 0:
+            map->check_mask = ~0ULL;
+            break;
+        case 1:
+            map->check_mask = map->checkers | chess_between_table[map->king][bitboard_lsb(map->checkers)];
+            break;
+        default:
+            // Double check, only the king can move
+            map->check_mask = 0;
+            break;
+    }
 }
 
-static int chess_controls(const chess_state_t *state, square_t target, char current) {
-    int result = 0;
-
-    ds_dynamic_array moves = {0};
-    ds_dynamic_array_init_allocator(&moves, sizeof(move_t), &allocator);
-
-    for (unsigned int file = 0; file < CHESS_WIDTH; file++) {
-        for (unsigned int rank = 0; rank < CHESS_HEIGHT; rank++) {
-            square_t square = (square_t){.file = file, .rank = rank};
-            char piece = chess_square_get(&state->board, square);
-
-            if ((piece & COLOR_FLAG) == current) {
-                ds_dynamic_array_clear(&moves);
-                chess_valid_moves(state, square, &moves, false);
-
-                for (unsigned int i = 0; i < moves.count; i++) {
-                    move_t *move = NULL;
-                    ds_dynamic_array_get_ref(&moves, i, (void **)&move);
-                    if (move->end.file == target.file && move->end.rank == target.rank) {
-                        return_defer(1);
-                    }
-                }
-            }
-        }
+const chess_attack_map_t *chess_attack_map_get(const chess_state_t *state, chess_attack_map_t *map) {
+    if (map->player != state->current_player || map->hash != state->hash) {
+        chess_attack_map_compute(state, map);
+    }
+
+    return map;
+}
+
+// The squares a piece on index can move to without exposing its king
+static bitboard_t chess_attack_map_allowed(const chess_attack_map_t *map, int index) {
+    if ((map->pinned & BB_SQUARE(index)) != 0) {
+        return map->check_mask & chess_line_table[map->king][index];
     }
 
-defer:
-    ds_dynamic_array_free(&moves);
-    return result;
+    return map->check_mask;
 }
 
-static void chess_valid_moves_king(const chess_state_t *state, square_t start, char piece_color, ds_dynamic_array *moves /* move_t */, boolean validate) {
-    int rank_diffs[] = {1, 1, -1, -1, 1, -1, 0, 0};
-    int file_diffs[] = {1, -1, 1, -1, 0, 0, 1, -1};
+typedef struct chess_check_squares_t {
+    int king; // Square index of the enemy king
+    bitboard_t squares[7]; // Targets from which each piece type would attack the enemy king
+    bitboard_t discoverers; // Own pieces that uncover a slider on the enemy king when they move off the line
+} chess_check_squares_t;
 
-    for (unsigned int i = 0; i < 8; i++) {
-        int rank_diff = rank_diffs[i];
-        int file_diff = file_diffs[i];
+static void chess_check_squares(const chess_state_t *state, char current, chess_check_squares_t *info) {
+    char enemy = chess_flip_player(current);
+    bitboard_t own = state->colors[COLOR_INDEX(current)];
+    bitboard_t occupied = state->colors[0] | state->colors[1];
+
+    info->king = state->king_square[COLOR_INDEX(enemy)];
+    if (info->king < 0) {
+        DS_PANIC("King not found");
+    }
 
-        square_t target = { .file = start.file + file_diff, .rank = start.rank + rank_diff };
-        if (target.file < 0 || target.file >= CHESS_WIDTH || target.rank < 0 || target.rank >= CHESS_HEIGHT) {
-            continue;
+    bitboard_t diagonal = chess_bishop_attacks(info->king, occupied);
+    bitboard_t straight = chess_rook_attacks(info->king, occupied);
+
+    info->squares[CHESS_NONE] = 0;
+    info->squares[CHESS_PAWN] = chess_pawn_table[COLOR_INDEX(enemy)][info->king];
+    info->squares[CHESS_KNIGHT] = chess_knight_table[info->king];
+    info->squares[CHESS_BISHOP] = diagonal;
+    info->squares[CHESS_ROOK] = straight;
+    info->squares[CHESS_QUEEN] = diagonal | straight;
+    info->squares[CHESS_KING] = 0;
+    info->discoverers = 0;
+
+    // Same as the pins in chess_attack_map_compute, but with our sliders aimed at their king
+    bitboard_t snipers =
+        ((chess_bishop_attacks(info->king, 0) & (state->pieces[CHESS_BISHOP] | state->pieces[CHESS_QUEEN])) |
+         (chess_rook_attacks(info->king, 0) & (state->pieces[CHESS_ROOK] | state->pieces[CHESS_QUEEN]))) & own;
+    while (snipers != 0) {
+        int sniper = bitboard_pop_lsb(&snipers);
+        bitboard_t blockers = chess_between_table[info->king][sniper] & occupied;
+        if (bitboard_count(blockers) == 1 && (blockers & own) != 0) {
+            info->discoverers |= blockers;
         }
+    }
+}
 
-        char piece = chess_square_get(&state->board, target);
-        if (chess_validate_move(state, MK_MOVE(start, target, CHESS_MOVE, CHESS_NONE), validate)) {
-            if (piece == CHESS_NONE) {
-                DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, target, CHESS_MOVE, CHESS_NONE)));
-            } else if ((piece & COLOR_FLAG) != piece_color) {
-                DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, target, CHESS_MOVE | CHESS_CAPTURE, CHESS_NONE)));
-            }
+// Whether a legal move of the side that owns the check squares checks the enemy king
+static boolean chess_check_squares_gives_check(const chess_state_t *state, const chess_check_squares_t *info, packed_move_t move) {
+    int start = PACKED_MOVE_START(move);
+    int end = PACKED_MOVE_END(move);
+    int flags = PACKED_MOVE_FLAGS(move);
+    char piece = state->board[start];
+    bitboard_t king = BB_SQUARE(info->king);
+    bitboard_t occupied = state->colors[0] | state->colors[1];
+
+    if ((flags & PACKED_MOVE_PROMOTE) != 0) {
+        // The new piece may look back through the square the pawn leaves
+        bitboard_t after = (occupied & ~BB_SQUARE(start)) | BB_SQUARE(end);
+        bitboard_t attacks = 0;
+        switch (CHESS_PROMOTE_OPTIONS[flags & 3]) {
+            case CHESS_KNIGHT: attacks = chess_knight_table[end]; break;
+            case CHESS_BISHOP: attacks = chess_bishop_attacks(end, after); break;
+            case CHESS_ROOK: attacks = chess_rook_attacks(end, after); break;
+            case CHESS_QUEEN: attacks = chess_bishop_attacks(end, after) | chess_rook_attacks(end, after); break;
+        }
+
+        if ((attacks & king) != 0) {
+            return true;
         }
+    } else if ((info->squares[piece & PIECE_FLAG] & BB_SQUARE(end)) != 0) {
+        return true;
     }
 
-    int home_rank = (piece_color == CHESS_WHITE) ? 0 : 7;
-    square_t king_square = MK_SQUARE(home_rank, 4);
-    int is_king_home = chess_square_get(&state->board, king_square) == (CHESS_KING | piece_color);
+    if ((info->discoverers & BB_SQUARE(start)) != 0 && (chess_line_table[info->king][start] & BB_SQUARE(end)) == 0) {
+        return true;
+    }
 
-    int is_in_check = validate == true && chess_controls(state, king_square, chess_flip_player(piece_color));
-    int is_short_check = validate == true && chess_controls(state, MK_SQUARE(home_rank, 5), chess_flip_player(piece_color));
-    int is_long_check = validate == true && chess_controls(state, MK_SQUARE(home_rank, 3), chess_flip_player(piece_color));
+    if (flags == PACKED_MOVE_ENPASSANT) {
+        // The captured pawn leaves a second hole, look again for our sliders from the king
+        int captured = (start / CHESS_WIDTH) * CHESS_WIDTH + end % CHESS_WIDTH;
+        bitboard_t after = occupied ^ BB_SQUARE(start) ^ BB_SQUARE(end) ^ BB_SQUARE(captured);
+        bitboard_t own = state->colors[COLOR_INDEX(piece & COLOR_FLAG)];
+        bitboard_t diagonal = (state->pieces[CHESS_BISHOP] | state->pieces[CHESS_QUEEN]) & own;
+        bitboard_t straight = (state->pieces[CHESS_ROOK] | state->pieces[CHESS_QUEEN]) & own;
 
-    square_t rook_short_square = MK_SQUARE(home_rank, 7);
-    int is_rook_short_home = chess_square_get(&state->board, rook_short_square) == (CHESS_ROOK | piece_color);
-    int is_short_free =
-        chess_square_get(&state->board, MK_SQUARE(home_rank, 5)) == CHESS_NONE &&
-        chess_square_get(&state->board, MK_SQUARE(home_rank, 6)) == CHESS_NONE;
-    int not_moved = (state->king_moved & piece_color) == 0 && (state->short_rook_moved & piece_color) == 0;
-    if (is_short_free && is_king_home && is_rook_short_home && not_moved && !is_in_check && !is_short_check) {
-        if (chess_validate_move(state, MK_MOVE(start, MK_SQUARE(home_rank, 6), CHESS_MOVE | CHESS_CASTLE_SHORT, CHESS_NONE), validate)) {
-            DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, MK_SQUARE(home_rank, 6), CHESS_MOVE | CHESS_CASTLE_SHORT, CHESS_NONE)));
-        }
+        return ((chess_bishop_attacks(info->king, after) & diagonal) | (chess_rook_attacks(info->king, after) & straight)) != 0;
     }
 
-    square_t rook_long_square = MK_SQUARE(home_rank, 0);
-    int is_rook_long_home = chess_square_get(&state->board, rook_long_square) == (CHESS_ROOK | piece_color);
-    int is_long_free =
-        chess_square_get(&state->board, MK_SQUARE(home_rank, 1)) == CHESS_NONE &&
-        chess_square_get(&state->board, MK_SQUARE(home_rank, 2)) == CHESS_NONE &&
-        chess_square_get(&state->board, MK_SQUARE(home_rank, 3)) == CHESS_NONE;
+    if (flags == PACKED_MOVE_CASTLE_SHORT || flags == PACKED_MOVE_CASTLE_LONG) {
+        int rook_start = (flags == PACKED_MOVE_CASTLE_SHORT) ? start + 3 : start - 4;
+        int rook_end = (flags == PACKED_MOVE_CASTLE_SHORT) ? start + 1 : start - 1;
+        bitboard_t after = occupied ^ BB_SQUARE(start) ^ BB_SQUARE(end) ^ BB_SQUARE(rook_start) ^ BB_SQUARE(rook_end);
 
-    int can_long = (state->king_moved & piece_color) == 0 && (state->long_rook_moved & piece_color) == 0;
-    if (is_long_free && is_king_home && is_rook_long_home && can_long && !is_in_check && !is_long_check) {
-        if (chess_validate_move(state, MK_MOVE(start, MK_SQUARE(home_rank, 2), CHESS_MOVE | CHESS_CASTLE_LONG, CHESS_NONE), validate)) {
-            DS_UNREACHABLE(ds_dynamic_array_append(moves, &MK_MOVE(start, MK_SQUARE(home_rank, 2), CHESS_MOVE | CHESS_CASTLE_LONG, CHESS_NONE)));
+        return (chess_rook_attacks(rook_end, after) & king) != 0;
+    }
+
+    return false;
+}
+
+static void chess_move_list_push(move_list_t *moves, packed_move_t move) {
+    moves->moves[moves->count++] = move;
+}
+
+static boolean chess_can_apply_move(const chess_state_t *state, move_t move) {
+    chess_state_t clone = {0};
+    DS_MEMCPY(&clone, state, sizeof(chess_state_t));
+
+    chess_apply_move(&clone, move);
+    if (chess_is_in_check(&clone, clone.current_player)) {
+        return false;
+    }
+
+    return true;
+}
+
+static void chess_append_pawn_move(move_list_t *moves, square_t start, square_t target, int flags) {
+    if (target.rank == 0 || target.rank == CHESS_HEIGHT - 1) {
+        for (int i = 0; i < 4; i++) {
+            chess_move_list_push(moves, MK_PACKED_MOVE(SQUARE_INDEX(start), SQUARE_INDEX(target), flags | PACKED_MOVE_PROMOTE | i));
         }
+    } else {
+        chess_move_list_push(moves, MK_PACKED_MOVE(SQUARE_INDEX(start), SQUARE_INDEX(target), flags));
     }
 }
 
-static void chess_valid_moves(const chess_state_t *state, square_t start, ds_dynamic_array *moves /* move_t */, boolean validate) {
-    char piece = chess_square_get(&state->board, start);
-    char piece_type = piece & PIECE_FLAG;
-    char piece_color = piece & COLOR_FLAG;
+static void chess_valid_moves_targets(const chess_state_t *state, square_t start, bitboard_t targets, move_list_t *moves) {
+    while (targets != 0) {
+        int index = bitboard_pop_lsb(&targets);
+        int flags = (state->board[index] == CHESS_NONE) ? PACKED_MOVE_QUIET : PACKED_MOVE_CAPTURE;
+
+        chess_move_list_push(moves, MK_PACKED_MOVE(SQUARE_INDEX(start), index, flags));
+    }
+}
+
+// Targets of the knight or slider on index, without the squares of its own pieces
+static bitboard_t chess_piece_targets(const chess_state_t *state, int index, char piece_type, char piece_color) {
+    bitboard_t occupied = state->colors[0] | state->colors[1];
+    bitboard_t attacks = 0;
 
     switch (piece_type) {
-        case CHESS_PAWN:
-            chess_valid_moves_pawn(state, start, piece_color, moves, validate);
-            break;
         case CHESS_KNIGHT:
-            chess_valid_moves_knight(state, start, piece_color, moves, validate);
+            attacks = chess_knight_table[index];
             break;
         case CHESS_BISHOP:
-            chess_valid_moves_bishop(state, start, piece_color, moves, validate);
+            attacks = chess_bishop_attacks(index, occupied);
             break;
         case CHESS_ROOK:
-            chess_valid_moves_rook(state, start, piece_color, moves, validate);
+            attacks = chess_rook_attacks(index, occupied);
             break;
         case CHESS_QUEEN:
-            chess_valid_moves_queen(state, start, piece_color, moves, validate);
-            break;
-        case CHESS_KING:
-            chess_valid_moves_king(state, start, piece_color, moves, validate);
+            attacks = chess_bishop_attacks(index, occupied) | chess_rook_attacks(index, occupied);
             break;
         default:
-            return;
+            break;
     }
+
+    return attacks & ~state->colors[COLOR_INDEX(piece_color)];
+}
+
+static int chess_controls(const chess_state_t *state, square_t target, char current) {
+    bitboard_t occupied = state->colors[0] | state->colors[1];
+
+    if (current == CHESS_WHITE) {
+        return chess_attackers_white(state, SQUARE_INDEX(target), occupied) != 0;
+    }
+
+    return chess_attackers_black(state, SQUARE_INDEX(target), occupied) != 0;
+}
+
+// The color dependent generators are stamped out once per color, so that the
+// directions, home ranks and color masks are constants in the inner loops
+#define CHESS_DEFINE_VALID_MOVES_PAWN(suffix, COLOR, FORWARD, SECOND_RANK, PROMOTION_RANK)                                                                                        \
+    static void chess_valid_moves_pawn_##suffix(const chess_state_t *state, square_t start, bitboard_t allowed, int type, move_list_t *moves) {                                   \
+        int captures = (type & CHESS_GENERATE_CAPTURES) != 0;                                                                                                                     \
+        int quiets = (type & CHESS_GENERATE_QUIETS) != 0;                                                                                                                         \
+        bitboard_t occupied = state->colors[0] | state->colors[1];                                                                                                                \
+                                                                                                                                                                                  \
+        /* Promotions are generated together with the captures */                                                                                                                 \
+        square_t forward = { .file = start.file, .rank = start.rank + (FORWARD) };                                                                                                \
+        int forward_type = (forward.rank == (PROMOTION_RANK)) ? captures : quiets;                                                                                                \
+        int forward_free = (occupied & BB_SQUARE(SQUARE_INDEX(forward))) == 0;                                                                                                    \
+        if (forward_type && forward_free && (allowed & BB_SQUARE(SQUARE_INDEX(forward))) != 0) {                                                                                  \
+            chess_append_pawn_move(moves, start, forward, PACKED_MOVE_QUIET);                                                                                                     \
+        }                                                                                                                                                                         \
+                                                                                                                                                                                  \
+        bitboard_t attacks = 0;                                                                                                                                                   \
+        if (captures) {                                                                                                                                                           \
+            attacks = chess_pawn_table[COLOR_INDEX(COLOR)][SQUARE_INDEX(start)] & state->colors[COLOR_INDEX(chess_flip_player(COLOR))] & allowed;                                 \
+        }                                                                                                                                                                         \
+        while (attacks != 0) {                                                                                                                                                    \
+            int target = bitboard_pop_lsb(&attacks);                                                                                                                              \
+            chess_append_pawn_move(moves, start, MK_SQUARE_INDEX(target), PACKED_MOVE_CAPTURE);                                                                                   \
+        }                                                                                                                                                                         \
+                                                                                                                                                                                  \
+        square_t forward2 = { .file = start.file, .rank = start.rank + 2 * (FORWARD) };                                                                                           \
+        if (quiets && start.rank == (SECOND_RANK) && forward_free && (occupied & BB_SQUARE(SQUARE_INDEX(forward2))) == 0 && (allowed & BB_SQUARE(SQUARE_INDEX(forward2))) != 0) { \
+            chess_move_list_push(moves, MK_PACKED_MOVE(SQUARE_INDEX(start), SQUARE_INDEX(forward2), PACKED_MOVE_QUIET));                                                          \
+        }                                                                                                                                                                         \
+                                                                                                                                                                                  \
+        /* En passant removes two pieces from the capture rank, so the masks */                                                                                                   \
+        /* cannot see every discovered check; verify it on a copy instead */                                                                                                      \
+        if (captures && state->enpassant >= 0 && (chess_pawn_table[COLOR_INDEX(COLOR)][SQUARE_INDEX(start)] & BB_SQUARE(state->enpassant)) != 0) {                                \
+            square_t forward_enp = MK_SQUARE_INDEX(state->enpassant);                                                                                                             \
+            if (chess_can_apply_move(state, MK_MOVE(start, forward_enp, CHESS_MOVE | CHESS_ENPASSANT | CHESS_CAPTURE, CHESS_NONE))) {                                             \
+                chess_move_list_push(moves, MK_PACKED_MOVE(SQUARE_INDEX(start), state->enpassant, PACKED_MOVE_ENPASSANT));                                                        \
+            }                                                                                                                                                                     \
+        }                                                                                                                                                                         \
+    }
+
+#define CHESS_DEFINE_VALID_MOVES_KING(suffix, COLOR, HOME_RANK, SHORT_RIGHT, LONG_RIGHT)                                                                                       \
+    static void chess_valid_moves_king_##suffix(const chess_state_t *state, square_t start, const chess_attack_map_t *map, bitboard_t allowed, int type, move_list_t *moves) { \
+        int index = SQUARE_INDEX(start);                                                                                                                                       \
+        int home = (HOME_RANK) * CHESS_WIDTH;                                                                                                                                  \
+                                                                                                                                                                               \
+        bitboard_t targets = chess_king_table[index] & ~state->colors[COLOR_INDEX(COLOR)] & ~map->threats & allowed;                                                           \
+        chess_valid_moves_targets(state, start, targets, moves);                                                                                                               \
+                                                                                                                                                                               \
+        if ((type & CHESS_GENERATE_QUIETS) == 0 || index != home + 4 || (state->castling & ((SHORT_RIGHT) | (LONG_RIGHT))) == 0 || map->checkers != 0) {                       \
+            return;                                                                                                                                                            \
+        }                                                                                                                                                                      \
+                                                                                                                                                                               \
+        bitboard_t occupied = state->colors[0] | state->colors[1];                                                                                                             \
+                                                                                                                                                                               \
+        bitboard_t short_path = BB_SQUARE(home + 5) | BB_SQUARE(home + 6);                                                                                                     \
+        int is_rook_short_home = state->board[home + 7] == (CHESS_ROOK | (COLOR));                                                                                             \
+        if ((state->castling & (SHORT_RIGHT)) != 0 && is_rook_short_home && ((occupied | map->threats) & short_path) == 0) {                                                   \
+            chess_move_list_push(moves, MK_PACKED_MOVE(index, home + 6, PACKED_MOVE_CASTLE_SHORT));                                                                            \
+        }                                                                                                                                                                      \
+                                                                                                                                                                               \
+        /* The rook passes the b file, the king does not */                                                                                                                    \
+        bitboard_t long_path = BB_SQUARE(home + 2) | BB_SQUARE(home + 3);                                                                                                      \
+        int is_rook_long_home = state->board[home] == (CHESS_ROOK | (COLOR));                                                                                                  \
+        if ((state->castling & (LONG_RIGHT)) != 0 && is_rook_long_home && ((occupied | map->threats) & long_path) == 0 &&                                                      \
+            (occupied & BB_SQUARE(home + 1)) == 0) {                                                                                                                           \
+            chess_move_list_push(moves, MK_PACKED_MOVE(index, home + 2, PACKED_MOVE_CASTLE_LONG));                                                                             \
+        }                                                                                                                                                                      \
+    }
+
+#define CHESS_DEFINE_GENERATE_TYPE(suffix, COLOR)                                                                                       \
+    static void chess_generate_type_##suffix(const chess_state_t *state, const chess_attack_map_t *map, int type, move_list_t *moves) { \
+        moves->count = 0;                                                                                                               \
+                                                                                                                                        \
+        bitboard_t occupied = state->colors[0] | state->colors[1];                                                                      \
+        bitboard_t type_targets = 0;                                                                                                    \
+        if ((type & CHESS_GENERATE_CAPTURES) != 0) {                                                                                    \
+            type_targets |= occupied;                                                                                                   \
+        }                                                                                                                               \
+        if ((type & CHESS_GENERATE_QUIETS) != 0) {                                                                                      \
+            type_targets |= ~occupied;                                                                                                  \
+        }                                                                                                                               \
+                                                                                                                                        \
+        bitboard_t pieces = state->colors[COLOR_INDEX(COLOR)];                                                                          \
+        while (pieces != 0) {                                                                                                           \
+            int index = bitboard_pop_lsb(&pieces);                                                                                      \
+            square_t start = MK_SQUARE_INDEX(index);                                                                                    \
+            bitboard_t allowed = chess_attack_map_allowed(map, index);                                                                  \
+            char piece_type = state->board[index] & PIECE_FLAG;                                                                         \
+                                                                                                                                        \
+            switch (piece_type) {                                                                                                       \
+                case CHESS_PAWN:                                                                                                        \
+                    chess_valid_moves_pawn_##suffix(state, start, allowed, type, moves);                                                \
+                    break;                                                                                                              \
+                case CHESS_KING:                                                                                                        \
+                    chess_valid_moves_king_##suffix(state, start, map, type_targets, type, moves);                                      \
+                    break;                                                                                                              \
+                default:                                                                                                                \
+                    allowed &= type_targets & chess_piece_targets(state, index, piece_type, (COLOR));                                   \
+                    chess_valid_moves_targets(state, start, allowed, moves);                                                            \
+                    break;                                                                                                              \
+            }                                                                                                                           \
+        }                                                                                                                               \
+    }
+
+#define CHESS_DEFINE_COUNT_MOVES(suffix, COLOR)                                                                                         \
+    /* Same walk as the generator, but pieces other than pawns and kings are only */                                                    \
+    /* counted; with first set it stops as soon as one legal move is found */                                                           \
+    static int chess_count_moves_##suffix(const chess_state_t *state, const chess_attack_map_t *map, boolean first) {                   \
+        move_list_t moves;                                                                                                              \
+        int count = 0;                                                                                                                  \
+                                                                                                                                        \
+        bitboard_t pieces = state->colors[COLOR_INDEX(COLOR)];                                                                          \
+        while (pieces != 0) {                                                                                                           \
+            int index = bitboard_pop_lsb(&pieces);                                                                                      \
+            square_t start = MK_SQUARE_INDEX(index);                                                                                    \
+            bitboard_t allowed = chess_attack_map_allowed(map, index);                                                                  \
+            char piece_type = state->board[index] & PIECE_FLAG;                                                                         \
+                                                                                                                                        \
+            moves.count = 0;                                                                                                            \
+            switch (piece_type) {                                                                                                       \
+                case CHESS_PAWN:                                                                                                        \
+                    chess_valid_moves_pawn_##suffix(state, start, allowed, CHESS_GENERATE_CAPTURES | CHESS_GENERATE_QUIETS, &moves);    \
+                    count += moves.count;                                                                                               \
+                    break;                                                                                                              \
+                case CHESS_KING:                                                                                                        \
+                    chess_valid_moves_king_##suffix(state, start, map, ~0ULL, CHESS_GENERATE_CAPTURES | CHESS_GENERATE_QUIETS, &moves); \
+                    count += moves.count;                                                                                               \
+                    break;                                                                                                              \
+                default:                                                                                                                \
+                    count += bitboard_count(chess_piece_targets(state, index, piece_type, (COLOR)) & allowed);                          \
+                    break;                                                                                                              \
+            }                                                                                                                           \
+                                                                                                                                        \
+            if (first && count > 0) {                                                                                                   \
+                return count;                                                                                                           \
+            }                                                                                                                           \
+        }                                                                                                                               \
+                                                                                                                                        \
+        return count;                                                                                                                   \
+    }
+
+#define CHESS_DEFINE_GENERATE_QUIET_CHECKS(suffix, COLOR)                                                                                         \
+    /* Quiet moves are masked to the squares that check the enemy king while */                                                                   \
+    /* they are generated: each piece type's check squares, plus every square */                                                                  \
+    /* off the line for a piece that uncovers a slider. Only castling is tested */                                                                \
+    /* after generation */                                                                                                                        \
+    static void chess_generate_quiet_checks_##suffix(const chess_state_t *state, const chess_attack_map_t *map, move_list_t *moves) {             \
+        moves->count = 0;                                                                                                                         \
+                                                                                                                                                  \
+        chess_check_squares_t info = {0};                                                                                                         \
+        chess_check_squares(state, (COLOR), &info);                                                                                               \
+                                                                                                                                                  \
+        bitboard_t empty = ~(state->colors[0] | state->colors[1]);                                                                                \
+        bitboard_t pieces = state->colors[COLOR_INDEX(COLOR)];                                                                                    \
+        while (pieces != 0) {                                                                                                                     \
+            int index = bitboard_pop_lsb(&pieces);                                                                                                \
+            square_t start = MK_SQUARE_INDEX(index);                                                                                              \
+            char piece_type = state->board[index] & PIECE_FLAG;                                                                                   \
+                                                                                                                                                  \
+            bitboard_t checking = info.squares[(int)piece_type];                                                                                  \
+            if ((info.discoverers & BB_SQUARE(index)) != 0) {                                                                                     \
+                checking |= ~chess_line_table[info.king][index];                                                                                  \
+            }                                                                                                                                     \
+                                                                                                                                                  \
+            switch (piece_type) {                                                                                                                 \
+                case CHESS_PAWN:                                                                                                                  \
+                    chess_valid_moves_pawn_##suffix(state, start, chess_attack_map_allowed(map, index) & checking, CHESS_GENERATE_QUIETS, moves); \
+                    break;                                                                                                                        \
+                case CHESS_KING: {                                                                                                                \
+                    int first = moves->count;                                                                                                     \
+                    chess_valid_moves_king_##suffix(state, start, map, empty & checking, CHESS_GENERATE_QUIETS, moves);                           \
+                                                                                                                                                  \
+                    /* Castling ignores the mask, its rook may still give check */                                                                \
+                    int count = first;                                                                                                            \
+                    for (int i = first; i < moves->count; i++) {                                                                                  \
+                        int flags = PACKED_MOVE_FLAGS(moves->moves[i]);                                                                           \
+                        int is_castle = flags == PACKED_MOVE_CASTLE_SHORT || flags == PACKED_MOVE_CASTLE_LONG;                                    \
+                        if (!is_castle || chess_check_squares_gives_check(state, &info, moves->moves[i])) {                                       \
+                            moves->moves[count++] = moves->moves[i];                                                                              \
+                        }                                                                                                                         \
+                    }                                                                                                                             \
+                    moves->count = count;                                                                                                         \
+                    break;                                                                                                                        \
+                }                                                                                                                                 \
+                default: {                                                                                                                        \
+                    bitboard_t allowed = chess_attack_map_allowed(map, index) & checking & empty;                                                 \
+                    allowed &= chess_piece_targets(state, index, piece_type, (COLOR));                                                            \
+                    chess_valid_moves_targets(state, start, allowed, moves);                                                                      \
+                    break;                                                                                                                        \
+                }                                                                                                                                 \
+            }                                                                                                                                     \
+        }                                                                                                                                         \
+    }
+
+CHESS_DEFINE_VALID_MOVES_PAWN(white, CHESS_WHITE, 1, 1, 7)
+CHESS_DEFINE_VALID_MOVES_PAWN(black, CHESS_BLACK, -1, 6, 0)
+CHESS_DEFINE_VALID_MOVES_KING(white, CHESS_WHITE, 0, CHESS_CASTLING_WHITE_SHORT, CHESS_CASTLING_WHITE_LONG)
+CHESS_DEFINE_VALID_MOVES_KING(black, CHESS_BLACK, 7, CHESS_CASTLING_BLACK_SHORT, CHESS_CASTLING_BLACK_LONG)
+CHESS_DEFINE_GENERATE_TYPE(white, CHESS_WHITE)
+CHESS_DEFINE_GENERATE_TYPE(black, CHESS_BLACK)
+CHESS_DEFINE_COUNT_MOVES(white, CHESS_WHITE)
+CHESS_DEFINE_COUNT_MOVES(black, CHESS_BLACK)
+CHESS_DEFINE_GENERATE_QUIET_CHECKS(white, CHESS_WHITE)
+CHESS_DEFINE_GENERATE_QUIET_CHECKS(black, CHESS_BLACK)
+
+void chess_init_tables(void) {
+    if (chess_tables_ready) {
+        return;
+    }
+
+    chess_init_magics(chess_rook_magics, chess_rook_magic_numbers, chess_rook_attack_table, chess_rook_rank_diffs, chess_rook_file_diffs);
+    chess_init_magics(chess_bishop_magics, chess_bishop_magic_numbers, chess_bishop_attack_table, chess_bishop_rank_diffs, chess_bishop_file_diffs);
+    chess_init_zobrist();
+
+    // Moving the king or a rook away, or capturing on a rook square, drops the rights
+    for (int index = 0; index < CHESS_WIDTH * CHESS_HEIGHT; index++) {
+        chess_castling_table[index] = CHESS_CASTLING_ALL;
+    }
+    chess_castling_table[4] &= ~(CHESS_CASTLING_WHITE_SHORT | CHESS_CASTLING_WHITE_LONG);
+    chess_castling_table[7] &= ~CHESS_CASTLING_WHITE_SHORT;
+    chess_castling_table[0] &= ~CHESS_CASTLING_WHITE_LONG;
+    chess_castling_table[60] &= ~(CHESS_CASTLING_BLACK_SHORT | CHESS_CASTLING_BLACK_LONG);
+    chess_castling_table[63] &= ~CHESS_CASTLING_BLACK_SHORT;
+    chess_castling_table[56] &= ~CHESS_CASTLING_BLACK_LONG;
+
+    // Targets of the leapers from every square, the set-wise shifts already drop the wrapped files
+    for (int index = 0; index < CHESS_WIDTH * CHESS_HEIGHT; index++) {
+        chess_knight_table[index] = chess_knight_attacks(BB_SQUARE(index));
+        chess_king_table[index] = chess_king_attacks(BB_SQUARE(index));
+        chess_pawn_table[COLOR_INDEX(CHESS_WHITE)][index] = chess_pawn_attacks(BB_SQUARE(index), CHESS_WHITE);
+        chess_pawn_table[COLOR_INDEX(CHESS_BLACK)][index] = chess_pawn_attacks(BB_SQUARE(index), CHESS_BLACK);
+    }
+
+    // Squares strictly between two aligned squares, and the full line through them
+    for (int a = 0; a < CHESS_WIDTH * CHESS_HEIGHT; a++) {
+        for (int b = 0; b < CHESS_WIDTH * CHESS_HEIGHT; b++) {
+            bitboard_t ends = BB_SQUARE(a) | BB_SQUARE(b);
+            chess_between_table[a][b] = 0;
+            chess_line_table[a][b] = 0;
+
+            if (a == b) {
+                continue;
+            }
+
+            if ((chess_rook_attacks(a, 0) & BB_SQUARE(b)) != 0) {
+                chess_between_table[a][b] = chess_rook_attacks(a, ends) & chess_rook_attacks(b, ends);
+                chess_line_table[a][b] = (chess_rook_attacks(a, 0) & chess_rook_attacks(b, 0)) | ends;
+            } else if ((chess_bishop_attacks(a, 0) & BB_SQUARE(b)) != 0) {
+                chess_between_table[a][b] = chess_bishop_attacks(a, ends) & chess_bishop_attacks(b, ends);
+                chess_line_table[a][b] = (chess_bishop_attacks(a, 0) & chess_bishop_attacks(b, 0)) | ends;
+            }
+        }
+    }
+
+    chess_tables_ready = true;
 }
 
 unsigned long chess_state_size(void) {
@@ -337,6 +787,8 @@ unsigned long chess_move_size(void) {
 }
 
 void chess_init_fen(chess_state_t *state, ds_string_slice fen) {
+    chess_init_tables();
+
     unsigned int rank = 0;
     unsigned int file = 0;
 
@@ -371,6 +823,22 @@ void chess_init_fen(chess_state_t *state, ds_string_slice fen) {
         }
     }
 
+    DS_MEMSET(state->pieces, 0, sizeof(state->pieces));
+    DS_MEMSET(state->colors, 0, sizeof(state->colors));
+    state->hash = 0;
+    state->king_square[COLOR_INDEX(CHESS_WHITE)] = -1;
+    state->king_square[COLOR_INDEX(CHESS_BLACK)] = -1;
+    for (int index = 0; index < CHESS_WIDTH * CHESS_HEIGHT; index++) {
+        char piece = state->board[index];
+        if (piece != CHESS_NONE) {
+            chess_piece_put(state, index, piece);
+        }
+
+        if ((piece & PIECE_FLAG) == CHESS_KING) {
+            state->king_square[COLOR_INDEX(piece & COLOR_FLAG)] = index;
+        }
+    }
+
     ds_string_slice current_player = {0};
     ds_string_slice_tokenize(&fen, ' ', &current_player);
     if (current_player.len > 0) {
@@ -378,6 +846,31 @@ void chess_init_fen(chess_state_t *state, ds_string_slice fen) {
     } else {
         state->current_player = CHESS_WHITE;
     }
+
+    // Positions without the castling field keep every right, as they always did
+    ds_string_slice castling = {0};
+    ds_string_slice_tokenize(&fen, ' ', &castling);
+    state->castling = (castling.len > 0) ? CHESS_NONE : CHESS_CASTLING_ALL;
+    for (unsigned int i = 0; i < castling.len; i++) {
+        switch (castling.str[i]) {
+            case 'K': state->castling |= CHESS_CASTLING_WHITE_SHORT; break;
+            case 'Q': state->castling |= CHESS_CASTLING_WHITE_LONG; break;
+            case 'k': state->castling |= CHESS_CASTLING_BLACK_SHORT; break;
+            case 'q': state->castling |= CHESS_CASTLING_BLACK_LONG; break;
+        }
+    }
+
+    ds_string_slice enpassant = {0};
+    ds_string_slice_tokenize(&fen, ' ', &enpassant);
+    state->enpassant = -1;
+    if (enpassant.len == 2 && enpassant.str[0] >= 'a' && enpassant.str[0] <= 'h' && enpassant.str[1] >= '1' && enpassant.str[1] <= '8') {
+        state->enpassant = SQUARE_INDEX(MK_SQUARE(enpassant.str[1] - '1', enpassant.str[0] - 'a'));
+    }
+
+    state->hash ^= chess_zobrist_extra(state);
+    if (state->current_player == CHESS_BLACK) {
+        state->hash ^= chess_zobrist_side;
+    }
 }
 
 void chess_dump_fen(const chess_state_t *state, char **fen) {
@@ -421,10 +914,21 @@ void chess_dump_fen(const chess_state_t *state, char **fen) {
 
     // Castling rights
     ds_string_builder_append(&sb, " ");
-    ds_string_builder_append(&sb, "KQkq");
+    if (state->castling == CHESS_NONE) ds_string_builder_append(&sb, "-");
+    if ((state->castling & CHESS_CASTLING_WHITE_SHORT) != 0) ds_string_builder_append(&sb, "K");
+    if ((state->castling & CHESS_CASTLING_WHITE_LONG) != 0) ds_string_builder_append(&sb, "Q");
+    if ((state->castling & CHESS_CASTLING_BLACK_SHORT) != 0) ds_string_builder_append(&sb, "k");
+    if ((state->castling & CHESS_CASTLING_BLACK_LONG) != 0) ds_string_builder_append(&sb, "q");
 
     // En passant
-    ds_string_builder_append(&sb, " - ");
+    ds_string_builder_append(&sb, " ");
+    if (state->enpassant >= 0) {
+        square_t square = MK_SQUARE_INDEX(state->enpassant);
+        ds_string_builder_append(&sb, "%c%c", 'a' + square.file, '1' + square.rank);
+    } else {
+        ds_string_builder_append(&sb, "-");
+    }
+    ds_string_builder_append(&sb, " ");
 
     // Halfmove clock
     ds_string_builder_append(&sb, "0");
@@ -450,6 +954,58 @@ void chess_square_set(chess_board_t *board, square_t square, char piece) {
     }
 }
 
+packed_move_t chess_move_pack(move_t move) {
+    int flags = PACKED_MOVE_QUIET;
+
+    if ((move.move & CHESS_CAPTURE) != 0) {
+        flags |= PACKED_MOVE_CAPTURE;
+    }
+
+    if ((move.move & CHESS_ENPASSANT) != 0) {
+        flags = PACKED_MOVE_ENPASSANT;
+    } else if ((move.move & CHESS_CASTLE_SHORT) != 0) {
+        flags = PACKED_MOVE_CASTLE_SHORT;
+    } else if ((move.move & CHESS_CASTLE_LONG) != 0) {
+        flags = PACKED_MOVE_CASTLE_LONG;
+    }
+
+    if (move.promotion != CHESS_NONE) {
+        for (int i = 0; i < 4; i++) {
+            if (CHESS_PROMOTE_OPTIONS[i] == (move.promotion & PIECE_FLAG)) {
+                flags |= PACKED_MOVE_PROMOTE | i;
+            }
+        }
+    }
+
+    return MK_PACKED_MOVE(SQUARE_INDEX(move.start), SQUARE_INDEX(move.end), flags);
+}
+
+move_t chess_move_unpack(packed_move_t move, char current) {
+    int flags = PACKED_MOVE_FLAGS(move);
+    char kind = CHESS_MOVE;
+    char promotion = CHESS_NONE;
+
+    if ((flags & PACKED_MOVE_CAPTURE) != 0) {
+        kind |= CHESS_CAPTURE;
+    }
+
+    if ((flags & PACKED_MOVE_PROMOTE) != 0) {
+        kind |= CHESS_PROMOTE;
+        promotion = CHESS_PROMOTE_OPTIONS[flags & 3] | current;
+    } else if (flags == PACKED_MOVE_ENPASSANT) {
+        kind |= CHESS_ENPASSANT;
+    } else if (flags == PACKED_MOVE_CASTLE_SHORT) {
+        kind |= CHESS_CASTLE_SHORT;
+    } else if (flags == PACKED_MOVE_CASTLE_LONG) {
+        kind |= CHESS_CASTLE_LONG;
+    }
+
+    int start = PACKED_MOVE_START(move);
+    int end = PACKED_MOVE_END(move);
+
+    return MK_MOVE(MK_SQUARE_INDEX(start), MK_SQUARE_INDEX(end), kind, promotion);
+}
+
 boolean chess_move_get(const move_t *moves, int count, move_t filter, int *index) {
     for (int i = 0; i < count; i++) {
         if (moves[i].start.file == filter.start.file && moves[i].start.rank == filter.start.rank &&
@@ -464,158 +1020,454 @@ boolean chess_move_get(const move_t *moves, int count, move_t filter, int *index
     return false;
 }
 
-void chess_apply_move(chess_state_t *state, move_t move) {
-    char piece = chess_square_get(&state->board, move.start);
+// Plays the move for the side owning the moving piece, without changing current_player
+static void chess_do_move(chess_state_t *state, packed_move_t move, chess_undo_t *undo) {
+    int start = PACKED_MOVE_START(move);
+    int end = PACKED_MOVE_END(move);
+    int flags = PACKED_MOVE_FLAGS(move);
+    int rank = start / CHESS_WIDTH;
+
+    char piece = state->board[start];
     char piece_type = piece & PIECE_FLAG;
     char piece_color = piece & COLOR_FLAG;
 
+    undo->last_move = state->last_move;
+    undo->last_move_start = state->last_move_start;
+    undo->last_move_end = state->last_move_end;
+    undo->castling = state->castling;
+    undo->enpassant = state->enpassant;
+    undo->hash = state->hash;
+
+    state->hash ^= chess_zobrist_extra(state);
+
     if (piece_type == CHESS_KING) {
-        state->king_moved |= piece_color;
+        state->king_square[COLOR_INDEX(piece_color)] = end;
     }
 
-    if (piece_type == CHESS_ROOK) {
-        int home_rank = (piece_color == CHESS_WHITE) ? 0 : 7;
-        if (move.start.file == 0 && move.start.rank == home_rank) {
-            state->long_rook_moved |= piece_color;
-        }
+    state->castling &= chess_castling_table[start] & chess_castling_table[end];
+    state->enpassant = -1;
+    if (piece_type == CHESS_PAWN && DS_ABS(end - start) == 2 * CHESS_WIDTH) {
+        state->enpassant = (start + end) / 2;
+    }
+
+    if (flags == PACKED_MOVE_CASTLE_SHORT) {
+        char rook = chess_piece_remove(state, SQUARE_INDEX(MK_SQUARE(rank, 7)));
+        chess_piece_put(state, SQUARE_INDEX(MK_SQUARE(rank, 5)), rook);
+    }
+
+    if (flags == PACKED_MOVE_CASTLE_LONG) {
+        char rook = chess_piece_remove(state, SQUARE_INDEX(MK_SQUARE(rank, 0)));
+        chess_piece_put(state, SQUARE_INDEX(MK_SQUARE(rank, 3)), rook);
+    }
+
+    if (flags == PACKED_MOVE_ENPASSANT) {
+        undo->captured = chess_piece_remove(state, SQUARE_INDEX(MK_SQUARE(rank, end % CHESS_WIDTH)));
+    } else {
+        undo->captured = chess_piece_remove(state, end);
+    }
+
+    chess_piece_remove(state, start);
+    if ((flags & PACKED_MOVE_PROMOTE) != 0) {
+        chess_piece_put(state, end, CHESS_PROMOTE_OPTIONS[flags & 3] | piece_color);
+    } else {
+        chess_piece_put(state, end, piece);
+    }
+
+    state->last_move = 1;
+    state->last_move_start = MK_SQUARE_INDEX(start);
+    state->last_move_end = MK_SQUARE_INDEX(end);
+
+    state->hash ^= chess_zobrist_extra(state);
+}
+
+void chess_apply_move(chess_state_t *state, move_t move) {
+    chess_undo_t undo = {0};
+    chess_do_move(state, chess_move_pack(move), &undo);
+}
+
+void chess_make_move(chess_state_t *state, packed_move_t move, chess_undo_t *undo) {
+    chess_do_move(state, move, undo);
+    state->current_player = chess_flip_player(state->current_player);
+    state->hash ^= chess_zobrist_side;
+}
+
+void chess_unmake_move(chess_state_t *state, packed_move_t move, const chess_undo_t *undo) {
+    int start = PACKED_MOVE_START(move);
+    int end = PACKED_MOVE_END(move);
+    int flags = PACKED_MOVE_FLAGS(move);
+    int rank = start / CHESS_WIDTH;
+
+    state->current_player = chess_flip_player(state->current_player);
+
+    char piece = chess_piece_remove(state, end);
+    if ((flags & PACKED_MOVE_PROMOTE) != 0) {
+        piece = CHESS_PAWN | (piece & COLOR_FLAG);
+    }
+    chess_piece_put(state, start, piece);
 
-        if (move.start.file == 7 && move.start.rank == home_rank) {
-            state->short_rook_moved |= piece_color;
+    if ((piece & PIECE_FLAG) == CHESS_KING) {
+        state->king_square[COLOR_INDEX(piece & COLOR_FLAG)] = start;
+    }
+
+    if (undo->captured != CHESS_NONE) {
+        if (flags == PACKED_MOVE_ENPASSANT) {
+            chess_piece_put(state, SQUARE_INDEX(MK_SQUARE(rank, end % CHESS_WIDTH)), undo->captured);
+        } else {
+            chess_piece_put(state, end, undo->captured);
         }
     }
 
-    if ((move.move & CHESS_CASTLE_SHORT) != 0) {
-        square_t rook = MK_SQUARE(move.start.rank, 7);
-        char piece = chess_square_get(&state->board, rook);
-        chess_square_set(&state->board, rook, CHESS_NONE);
-        rook = MK_SQUARE(move.start.rank, 5);
-        chess_square_set(&state->board, rook, piece);
+    if (flags == PACKED_MOVE_CASTLE_SHORT) {
+        char rook = chess_piece_remove(state, SQUARE_INDEX(MK_SQUARE(rank, 5)));
+        chess_piece_put(state, SQUARE_INDEX(MK_SQUARE(rank, 7)), rook);
     }
 
-    if ((move.move & CHESS_CASTLE_LONG) != 0) {
-        square_t rook = MK_SQUARE(move.start.rank, 0);
-        char piece = chess_square_get(&state->board, rook);
-        chess_square_set(&state->board, rook, CHESS_NONE);
-        rook = MK_SQUARE(move.start.rank, 3);
-        chess_square_set(&state->board, rook, piece);
+    if (flags == PACKED_MOVE_CASTLE_LONG) {
+        char rook = chess_piece_remove(state, SQUARE_INDEX(MK_SQUARE(rank, 3)));
+        chess_piece_put(state, SQUARE_INDEX(MK_SQUARE(rank, 0)), rook);
     }
 
-    if ((move.move & CHESS_ENPASSANT) != 0) {
-        square_t take = (square_t){ .rank = move.start.rank, .file = move.end.file };
-        chess_square_set(&state->board, take, CHESS_NONE);
+    state->last_move = undo->last_move;
+    state->last_move_start = undo->last_move_start;
+    state->last_move_end = undo->last_move_end;
+    state->castling = undo->castling;
+    state->enpassant = undo->enpassant;
+    state->hash = undo->hash;
+}
+
+static void chess_generate_type(const chess_state_t *state, const chess_attack_map_t *map, int type, move_list_t *moves) {
+    if (state->current_player == CHESS_WHITE) {
+        chess_generate_type_white(state, map, type, moves);
+    } else {
+        chess_generate_type_black(state, map, type, moves);
     }
+}
+
+void chess_generate_move_list(const chess_state_t *state, move_list_t *moves) {
+    chess_attack_map_t map;
+    chess_attack_map_compute(state, &map);
+
+    chess_generate_type(state, &map, CHESS_GENERATE_CAPTURES | CHESS_GENERATE_QUIETS, moves);
+}
+
+void chess_generate_captures(const chess_state_t *state, const chess_attack_map_t *map, move_list_t *moves) {
+    chess_generate_type(state, map, CHESS_GENERATE_CAPTURES, moves);
+}
 
-    if ((move.move & CHESS_MOVE) != 0) {
-        chess_square_set(&state->board, move.end, chess_square_get(&state->board, move.start));
-        chess_square_set(&state->board, move.start, CHESS_NONE);
+void chess_generate_quiets(const chess_state_t *state, const chess_attack_map_t *map, move_list_t *moves) {
+    chess_generate_type(state, map, CHESS_GENERATE_QUIETS, moves);
+}
+
+void chess_generate_quiet_checks(const chess_state_t *state, const chess_attack_map_t *map, move_list_t *moves) {
+    if (state->current_player == CHESS_WHITE) {
+        chess_generate_quiet_checks_white(state, map, moves);
+    } else {
+        chess_generate_quiet_checks_black(state, map, moves);
     }
+}
 
-    if (move.move != CHESS_NONE) {
-        state->last_move = 1;
-        state->last_move_start = move.start;
-        state->last_move_end = move.end;
+int chess_count_legal_moves(const chess_state_t *state, const chess_attack_map_t *map) {
+    if (state->current_player == CHESS_WHITE) {
+        return chess_count_moves_white(state, map, false);
     }
 
-    if (move.promotion != CHESS_NONE) {
-        chess_square_set(&state->board, move.end, move.promotion);
+    return chess_count_moves_black(state, map, false);
+}
+
+boolean chess_has_legal_move(const chess_state_t *state, const chess_attack_map_t *map) {
+    if (state->current_player == CHESS_WHITE) {
+        return chess_count_moves_white(state, map, true) > 0;
     }
+
+    return chess_count_moves_black(state, map, true) > 0;
 }
 
-void chess_generate_moves(const chess_state_t *state, ds_dynamic_array *moves) {
-    ds_dynamic_array_clear(moves);
+int chess_generate_moves_batch(const chess_state_t *states, int count, packed_move_t *moves, int capacity, int *offsets) {
+    move_list_t list;
 
-    for (unsigned int file = 0; file < CHESS_WIDTH; file++) {
-        for (unsigned int rank = 0; rank < CHESS_HEIGHT; rank++) {
-            square_t start = (square_t){.file = file, .rank = rank};
-            char piece = chess_square_get(&state->board, start);
+    offsets[0] = 0;
+    for (int i = 0; i < count; i++) {
+        chess_generate_move_list(&states[i], &list);
+        if (offsets[i] + list.count > capacity) {
+            return i;
+        }
 
-            if ((piece & COLOR_FLAG) == state->current_player) {
-                chess_valid_moves(state, start, moves, true);
-            }
+        DS_MEMCPY(moves + offsets[i], list.moves, list.count * sizeof(packed_move_t));
+        offsets[i + 1] = offsets[i] + list.count;
+    }
+
+    return count;
+}
+
+// Castling is only generated when it is fully legal, so look it up in the king moves
+static boolean chess_is_castle_legal(const chess_state_t *state, const chess_attack_map_t *map, packed_move_t move) {
+    move_list_t list;
+    list.count = 0;
+
+    square_t start = MK_SQUARE_INDEX(PACKED_MOVE_START(move));
+    if (state->current_player == CHESS_WHITE) {
+        chess_valid_moves_king_white(state, start, map, 0, CHESS_GENERATE_QUIETS, &list);
+    } else {
+        chess_valid_moves_king_black(state, start, map, 0, CHESS_GENERATE_QUIETS, &list);
+    }
+
+    for (int i = 0; i < list.count; i++) {
+        if (list.moves[i] == move) {
+            return true;
         }
     }
+
+    return false;
 }
 
-int chess_is_in_check(const chess_state_t *state, char current) {
-    char enemy = chess_flip_player(current);
+boolean chess_is_pseudo_legal(const chess_state_t *state, packed_move_t move) {
+    int start = PACKED_MOVE_START(move);
+    int end = PACKED_MOVE_END(move);
+    int flags = PACKED_MOVE_FLAGS(move);
+    char color = state->current_player;
 
-    square_t king_square = {0};
-    int found = 0;
-    for (unsigned int file = 0; file < CHESS_WIDTH && found == 0; file++) {
-        for (unsigned int rank = 0; rank < CHESS_HEIGHT && found == 0; rank++) {
-            square_t square = (square_t){.file = file, .rank = rank};
-            char piece = chess_square_get(&state->board, square);
+    bitboard_t own = state->colors[COLOR_INDEX(color)];
+    bitboard_t enemy = state->colors[COLOR_INDEX(chess_flip_player(color))];
+    if ((own & BB_SQUARE(start)) == 0 || (own & BB_SQUARE(end)) != 0) {
+        return false;
+    }
 
-            if (piece == (CHESS_KING | current)) {
-                king_square = square;
-                found = 1;
-            }
+    char piece_type = state->board[start] & PIECE_FLAG;
+    int is_capture = (enemy & BB_SQUARE(end)) != 0;
+
+    if (piece_type == CHESS_PAWN) {
+        int forward = (color == CHESS_WHITE) ? CHESS_WIDTH : -CHESS_WIDTH;
+        int second_rank = (color == CHESS_WHITE) ? 1 : 6;
+        int promotion_rank = (color == CHESS_WHITE) ? 7 : 0;
+        bitboard_t attacks = chess_pawn_table[COLOR_INDEX(color)][start];
+
+        if (flags == PACKED_MOVE_ENPASSANT) {
+            return end == state->enpassant && (attacks & BB_SQUARE(end)) != 0;
+        }
+
+        if (((flags & PACKED_MOVE_PROMOTE) != 0) != (end / CHESS_WIDTH == promotion_rank)) {
+            return false;
+        }
+
+        int kind = ((flags & PACKED_MOVE_PROMOTE) != 0) ? (flags & ~(PACKED_MOVE_PROMOTE | 3)) : flags;
+        if (kind == PACKED_MOVE_CAPTURE) {
+            return is_capture && (attacks & BB_SQUARE(end)) != 0;
         }
+
+        if (kind != PACKED_MOVE_QUIET || is_capture) {
+            return false;
+        }
+
+        bitboard_t occupied = own | enemy;
+        if (end == start + forward) {
+            return (occupied & BB_SQUARE(end)) == 0;
+        }
+
+        return end == start + 2 * forward && start / CHESS_WIDTH == second_rank &&
+               (occupied & (BB_SQUARE(start + forward) | BB_SQUARE(end))) == 0;
     }
 
-    if (found == 0) {
-        DS_PANIC("King not found");
+    if (flags == PACKED_MOVE_CASTLE_SHORT || flags == PACKED_MOVE_CASTLE_LONG) {
+        if (piece_type != CHESS_KING) {
+            return false;
+        }
+
+        chess_attack_map_t map;
+        chess_attack_map_compute(state, &map);
+
+        return chess_is_castle_legal(state, &map, move);
     }
 
-    return chess_controls(state, king_square, enemy);
+    if (flags != (is_capture ? PACKED_MOVE_CAPTURE : PACKED_MOVE_QUIET)) {
+        return false;
+    }
+
+    if (piece_type == CHESS_KING) {
+        return (chess_king_table[start] & BB_SQUARE(end)) != 0;
+    }
+
+    return (chess_piece_targets(state, start, piece_type, color) & BB_SQUARE(end)) != 0;
 }
 
-char chess_checkmate(const chess_state_t *state) {
-    if (state->current_player == CHESS_WHITE && chess_is_checkmate(state, CHESS_WHITE)) {
-        return CHESS_WHITE;
+boolean chess_is_legal(const chess_state_t *state, const chess_attack_map_t *map, packed_move_t move) {
+    int start = PACKED_MOVE_START(move);
+    int end = PACKED_MOVE_END(move);
+    int flags = PACKED_MOVE_FLAGS(move);
+    char color = state->current_player;
+
+    // Checked here rather than in chess_is_pseudo_legal, which has no map to hand
+    if (flags == PACKED_MOVE_CASTLE_SHORT || flags == PACKED_MOVE_CASTLE_LONG) {
+        return state->board[start] == (CHESS_KING | color) && chess_is_castle_legal(state, map, move);
     }
 
-    if (state->current_player == CHESS_BLACK && chess_is_checkmate(state, CHESS_BLACK)) {
-        return CHESS_BLACK;
+    if (!chess_is_pseudo_legal(state, move)) {
+        return false;
     }
 
-    return CHESS_NONE;
+    if (flags == PACKED_MOVE_ENPASSANT) {
+        return chess_can_apply_move(state, chess_move_unpack(move, color));
+    }
+
+    if (start == map->king) {
+        return (map->threats & BB_SQUARE(end)) == 0;
+    }
+
+    return (chess_attack_map_allowed(map, start) & BB_SQUARE(end)) != 0;
 }
 
-int chess_draw(const chess_state_t *state) {
-    return chess_is_stalemate(state, CHESS_WHITE) || chess_is_stalemate(state, CHESS_BLACK);
+boolean chess_move_gives_check(const chess_state_t *state, packed_move_t move) {
+    chess_check_squares_t info = {0};
+    chess_check_squares(state, state->current_player, &info);
+
+    return chess_check_squares_gives_check(state, &info, move);
 }
 
-int chess_is_checkmate(const chess_state_t *state, char current) {
-    int result = 0;
+const int chess_piece_values[7] = {
+    [CHESS_PAWN] = EVAL_PAWN, [CHESS_KNIGHT] = EVAL_KNIGHT, [CHESS_BISHOP] = EVAL_BISHOP,
+    [CHESS_ROOK] = EVAL_ROOK, [CHESS_QUEEN] = EVAL_QUEEN, [CHESS_KING] = EVAL_KING,
+};
 
-    ds_dynamic_array moves = {0};
-    ds_dynamic_array_init_allocator(&moves, sizeof(move_t), &allocator);
+const char chess_piece_ranks[7] = {
+    [CHESS_PAWN] = 1, [CHESS_KNIGHT] = 2, [CHESS_BISHOP] = 3,
+    [CHESS_ROOK] = 4, [CHESS_QUEEN] = 5, [CHESS_KING] = 6,
+};
 
-    int check = chess_is_in_check(state, current);
+int chess_see(const chess_state_t *state, packed_move_t move) {
+    int start = PACKED_MOVE_START(move);
+    int end = PACKED_MOVE_END(move);
+    int flags = PACKED_MOVE_FLAGS(move);
 
-    if (check == 0) {
-        return_defer(0);
+    if (flags == PACKED_MOVE_CASTLE_SHORT || flags == PACKED_MOVE_CASTLE_LONG) {
+        return 0;
     }
 
-    chess_generate_moves(state, &moves);
+    bitboard_t occupied = (state->colors[0] | state->colors[1]) & ~BB_SQUARE(start);
+    bitboard_t diagonal = state->pieces[CHESS_BISHOP] | state->pieces[CHESS_QUEEN];
+    bitboard_t straight = state->pieces[CHESS_ROOK] | state->pieces[CHESS_QUEEN];
+
+    // gain[i] is the balance for the side that made capture i, if the exchange stopped there
+    int gain[32] = {0};
+    int on_square = chess_piece_values[state->board[start] & PIECE_FLAG];
+    if (flags == PACKED_MOVE_ENPASSANT) {
+        occupied &= ~BB_SQUARE((start / CHESS_WIDTH) * CHESS_WIDTH + end % CHESS_WIDTH);
+        gain[0] = EVAL_PAWN;
+    } else if ((flags & PACKED_MOVE_CAPTURE) != 0) {
+        gain[0] = chess_piece_values[state->board[end] & PIECE_FLAG];
+    }
 
-    if (check && moves.count == 0) {
-        return_defer(1);
+    if ((flags & PACKED_MOVE_PROMOTE) != 0) {
+        char promoted = CHESS_PROMOTE_OPTIONS[flags & 3];
+        gain[0] += chess_piece_values[(int)promoted] - EVAL_PAWN;
+        on_square = chess_piece_values[(int)promoted];
     }
 
-defer:
-    ds_dynamic_array_free(&moves);
-    return result;
+    bitboard_t attackers = chess_attackers(state, end, occupied) & occupied;
+    char side = chess_flip_player(state->current_player);
+
+    int depth = 0;
+    while (depth < 31) {
+        bitboard_t own = attackers & state->colors[COLOR_INDEX(side)];
+        if (own == 0) {
+            break;
+        }
+
+        char piece = CHESS_NONE;
+        for (char type = CHESS_PAWN; type <= CHESS_KING; type++) {
+            boolean lower = piece == CHESS_NONE || chess_piece_ranks[(int)type] < chess_piece_ranks[(int)piece];
+            if ((own & state->pieces[(int)type]) != 0 && lower) {
+                piece = type;
+            }
+        }
+
+        int from = bitboard_lsb(own & state->pieces[(int)piece]);
+
+        depth += 1;
+        gain[depth] = on_square - gain[depth - 1];
+        on_square = chess_piece_values[(int)piece];
+        if (piece == CHESS_PAWN && (end < CHESS_WIDTH || end >= (CHESS_HEIGHT - 1) * CHESS_WIDTH)) {
+            gain[depth] += EVAL_QUEEN - EVAL_PAWN;
+            on_square = EVAL_QUEEN;
+        }
+
+        // Sliders lined up behind the piece that just captured join the exchange
+        occupied &= ~BB_SQUARE(from);
+        attackers |= (chess_bishop_attacks(end, occupied) & diagonal) | (chess_rook_attacks(end, occupied) & straight);
+        attackers &= occupied;
+
+        side = chess_flip_player(side);
+
+        // The king can only take when nothing is left to take it back
+        if (piece == CHESS_KING && (attackers & state->colors[COLOR_INDEX(side)]) != 0) {
+            depth -= 1;
+            break;
+        }
+    }
+
+    // Walk back, each side only carries on with the exchange if that beats stopping
+    while (depth > 0) {
+        if (-gain[depth - 1] < gain[depth]) {
+            gain[depth - 1] = -gain[depth];
+        }
+        depth -= 1;
+    }
+
+    return gain[0];
 }
 
-int chess_is_stalemate(const chess_state_t *state, char current) {
-    int result = 0;
+void chess_generate_moves(const chess_state_t *state, ds_dynamic_array *moves) {
+    move_list_t list = {0};
+    chess_generate_move_list(state, &list);
+
+    ds_dynamic_array_clear(moves);
+    for (int i = 0; i < list.count; i++) {
+        move_t move = chess_move_unpack(list.moves[i], state->current_player);
+        DS_UNREACHABLE(ds_dynamic_array_append(moves, &move));
+    }
+}
 
-    ds_dynamic_array moves = {0};
-    ds_dynamic_array_init_allocator(&moves, sizeof(move_t), &allocator);
+int chess_is_in_check(const chess_state_t *state, char current) {
+    char enemy = chess_flip_player(current);
 
-    int check = chess_is_in_check(state, current);
+    int king = state->king_square[COLOR_INDEX(current)];
+    if (king < 0) {
+        DS_PANIC("King not found");
+    }
 
-    chess_generate_moves(state, &moves);
+    return chess_controls(state, MK_SQUARE_INDEX(king), enemy);
+}
 
-    if (check == 0 && moves.count == 0) {
-        return_defer(1);
+int chess_status(const chess_state_t *state, const chess_attack_map_t *map) {
+    if (chess_has_legal_move(state, map)) {
+        return CHESS_STATUS_PLAYING;
     }
 
-defer:
-    ds_dynamic_array_free(&moves);
-    return result;
+    return (map->checkers != 0) ? CHESS_STATUS_CHECKMATE : CHESS_STATUS_STALEMATE;
+}
+
+char chess_checkmate(const chess_state_t *state) {
+    chess_attack_map_t map;
+    chess_attack_map_compute(state, &map);
+
+    if (chess_status(state, &map) == CHESS_STATUS_CHECKMATE) {
+        return state->current_player;
+    }
+
+    return CHESS_NONE;
+}
+
+int chess_draw(const chess_state_t *state) {
+    chess_attack_map_t map;
+    chess_attack_map_compute(state, &map);
+
+    return chess_status(state, &map) == CHESS_STATUS_STALEMATE;
+}
+
+int chess_is_checkmate(const chess_state_t *state, char current) {
+    return current == state->current_player && chess_checkmate(state) == current;
+}
+
+int chess_is_stalemate(const chess_state_t *state, char current) {
+    return current == state->current_player && chess_draw(state);
 }
 
 int chess_is_draw(const chess_state_t *state, char current) {
@@ -634,32 +1486,14 @@ char chess_flip_player(char current) {
 }
 
 int chess_count_material(const chess_state_t *state, char current) {
-    int material = 0;
-
-    for (unsigned int file = 0; file < CHESS_WIDTH; file++) {
-        for (unsigned int rank = 0; rank < CHESS_HEIGHT; rank++) {
-            square_t start = (square_t){.file = file, .rank = rank};
-            char piece = chess_square_get(&state->board, start);
-
-            if ((piece & COLOR_FLAG) == current) {
-                if ((piece & PIECE_FLAG) == CHESS_PAWN) {
-                    material += EVAL_PAWN;
-                } else if ((piece & PIECE_FLAG) == CHESS_KNIGHT) {
-                    material += EVAL_KNIGHT;
-                } else if ((piece & PIECE_FLAG) == CHESS_BISHOP) {
-                    material += EVAL_BISHOP;
-                } else if ((piece & PIECE_FLAG) == CHESS_ROOK) {
-                    material += EVAL_ROOK;
-                } else if ((piece & PIECE_FLAG) == CHESS_QUEEN) {
-                    material += EVAL_QUEEN;
-                } else if ((piece & PIECE_FLAG) == CHESS_KING) {
-                    material += EVAL_KING;
-                }
-            }
-        }
-    }
-
-    return material;
+    bitboard_t own = state->colors[COLOR_INDEX(current)];
+
+    return EVAL_PAWN * bitboard_count(state->pieces[CHESS_PAWN] & own) +
+           EVAL_KNIGHT * bitboard_count(state->pieces[CHESS_KNIGHT] & own) +
+           EVAL_BISHOP * bitboard_count(state->pieces[CHESS_BISHOP] & own) +
+           EVAL_ROOK * bitboard_count(state->pieces[CHESS_ROOK] & own) +
+           EVAL_QUEEN * bitboard_count(state->pieces[CHESS_QUEEN] & own) +
+           EVAL_KING * bitboard_count(state->pieces[CHESS_KING] & own);
 }
 
 // Where the pawn wants to go from white perspective
@@ -725,39 +1559,46 @@ static chess_board_t chess_king_heatmap = {
 int chess_count_material_weighted(const chess_state_t *state, char current) {
     int material = 0;
 
-    for (unsigned int file = 0; file < CHESS_WIDTH; file++) {
-        for (unsigned int rank = 0; rank < CHESS_HEIGHT; rank++) {
-            square_t start = (square_t){.file = file, .rank = rank};
-            square_t heat = (current == CHESS_WHITE) ? (square_t){.file = file, .rank = rank} : (square_t){.file = file, .rank = CHESS_HEIGHT - rank - 1};
-            char piece = chess_square_get(&state->board, start);
-
-            if ((piece & COLOR_FLAG) == current) {
-                if ((piece & PIECE_FLAG) == CHESS_PAWN) {
-                    material += (EVAL_PAWN + 10 * chess_square_get(&chess_pawn_heatmap, heat));
-                } else if ((piece & PIECE_FLAG) == CHESS_KNIGHT) {
-                    material += (EVAL_KNIGHT + 10 * chess_square_get(&chess_knight_heatmap, heat));
-                } else if ((piece & PIECE_FLAG) == CHESS_BISHOP) {
-                    material += (EVAL_BISHOP + 10 * chess_square_get(&chess_bishop_heatmap, heat));
-                } else if ((piece & PIECE_FLAG) == CHESS_ROOK) {
-                    material += (EVAL_ROOK + 10 * chess_square_get(&chess_rook_heatmap, heat));
-                } else if ((piece & PIECE_FLAG) == CHESS_QUEEN) {
-                    material += EVAL_QUEEN;
-                } else if ((piece & PIECE_FLAG) == CHESS_KING) {
-                    material += (EVAL_KING + 10 * chess_square_get(&chess_king_heatmap, heat));
-                }
-            }
+    bitboard_t pieces = state->colors[COLOR_INDEX(current)];
+    while (pieces != 0) {
+        int index = bitboard_pop_lsb(&pieces);
+        square_t start = MK_SQUARE_INDEX(index);
+        square_t heat = (current == CHESS_WHITE) ? start : MK_SQUARE(CHESS_HEIGHT - start.rank - 1, start.file);
+        char piece = state->board[index];
+
+        if ((piece & PIECE_FLAG) == CHESS_PAWN) {
+            material += (EVAL_PAWN + 10 * chess_square_get(&chess_pawn_heatmap, heat));
+        } else if ((piece & PIECE_FLAG) == CHESS_KNIGHT) {
+            material += (EVAL_KNIGHT + 10 * chess_square_get(&chess_knight_heatmap, heat));
+        } else if ((piece & PIECE_FLAG) == CHESS_BISHOP) {
+            material += (EVAL_BISHOP + 10 * chess_square_get(&chess_bishop_heatmap, heat));
+        } else if ((piece & PIECE_FLAG) == CHESS_ROOK) {
+            material += (EVAL_ROOK + 10 * chess_square_get(&chess_rook_heatmap, heat));
+        } else if ((piece & PIECE_FLAG) == CHESS_QUEEN) {
+            material += EVAL_QUEEN;
+        } else if ((piece & PIECE_FLAG) == CHESS_KING) {
+            material += (EVAL_KING + 10 * chess_square_get(&chess_king_heatmap, heat));
         }
     }
 
     return material;
 }
 
-void chess_count_positions(const chess_state_t *state, int depth, perft_t *perft) {
-    if (chess_is_in_check(state, state->current_player)) {
+static void chess_count_positions_rec(chess_state_t *state, int depth, boolean in_check, perft_t *perft) {
+    if (in_check) {
         perft->checks += 1;
     }
 
-    if (chess_is_checkmate(state, state->current_player)) {
+    // Quiet leaves need neither the mate test nor the moves
+    if (!in_check && depth == 0) {
+        perft->nodes += 1;
+        return;
+    }
+
+    chess_attack_map_t map;
+    chess_attack_map_compute(state, &map);
+
+    if (in_check && !chess_has_legal_move(state, &map)) {
         if (depth == 0) {
             perft->nodes += 1;
         }
@@ -770,52 +1611,45 @@ void chess_count_positions(const chess_state_t *state, int depth, perft_t *perft
         return;
     }
 
-    ds_dynamic_array moves = {0};
-    ds_dynamic_array_init_allocator(&moves, sizeof(move_t), &allocator);
+    move_list_t moves = {0};
+    chess_generate_type(state, &map, CHESS_GENERATE_CAPTURES | CHESS_GENERATE_QUIETS, &moves);
 
-    for (unsigned int file = 0; file < CHESS_WIDTH; file++) {
-        for (unsigned int rank = 0; rank < CHESS_HEIGHT; rank++) {
-            square_t start = (square_t){.file = file, .rank = rank};
-            char piece = chess_square_get(&state->board, start);
+    // Checks are found from the parent, before the moves are played
+    chess_check_squares_t info = {0};
+    chess_check_squares(state, state->current_player, &info);
 
-            if ((piece & COLOR_FLAG) == state->current_player) {
-                ds_dynamic_array_clear(&moves);
-                chess_valid_moves(state, start, &moves, true);
+    for (int i = 0; i < moves.count; i++) {
+        int flags = PACKED_MOVE_FLAGS(moves.moves[i]);
+        boolean gives_check = chess_check_squares_gives_check(state, &info, moves.moves[i]);
 
-                for (unsigned int i = 0; i < moves.count; i++) {
-                    move_t *move = NULL;
-                    DS_UNREACHABLE(ds_dynamic_array_get_ref(&moves, i, (void **)&move));
-
-                    if ((move->move & CHESS_ENPASSANT) != 0) {
-                        perft->enp += 1;
-                    }
-
-                    if ((move->move & CHESS_CASTLE_SHORT) != 0 || (move->move & CHESS_CASTLE_LONG) != 0) {
-                        perft->castles += 1;
-                    }
+        if (flags == PACKED_MOVE_ENPASSANT) {
+            perft->enp += 1;
+        }
 
-                    if ((move->move & CHESS_PROMOTE) != 0) {
-                        perft->promote += 1;
-                    }
+        if (flags == PACKED_MOVE_CASTLE_SHORT || flags == PACKED_MOVE_CASTLE_LONG) {
+            perft->castles += 1;
+        }
 
-                    if ((move->move & CHESS_CAPTURE) != 0) {
-                        perft->captures += 1;
-                    }
+        if ((flags & PACKED_MOVE_PROMOTE) != 0) {
+            perft->promote += 1;
+        }
 
-                    if (move->move != CHESS_NONE) {
-                        chess_state_t clone = {0};
-                        DS_MEMCPY(&clone, state, sizeof(chess_state_t));
+        if ((flags & PACKED_MOVE_CAPTURE) != 0) {
+            perft->captures += 1;
+        }
 
-                        chess_apply_move(&clone, *move);
+        chess_undo_t undo = {0};
+        chess_make_move(state, moves.moves[i], &undo);
 
-                        clone.current_player = chess_flip_player(clone.current_player);
+        chess_count_positions_rec(state, depth - 1, gives_check, perft);
 
-                        chess_count_positions(&clone, depth - 1, perft);
-                    }
-                }
-            }
-        }
+        chess_unmake_move(state, moves.moves[i], &undo);
     }
+}
+
+void chess_count_positions(const chess_state_t *state, int depth, perft_t *perft) {
+    chess_state_t position = {0};
+    DS_MEMCPY(&position, state, sizeof(chess_state_t));
 
-    ds_dynamic_array_free(&moves);
+    chess_count_positions_rec(&position, depth, chess_is_in_check(&position, position.current_player), perft);
 }
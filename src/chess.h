@@ -10,6 +10,10 @@
 
 typedef char chess_board_t[CHESS_HEIGHT * CHESS_WIDTH];
 
+// One bit per square, bit `rank * CHESS_WIDTH + file` is the square at rank, file
+typedef unsigned long long bitboard_t;
+typedef unsigned long long zobrist_t;
+
 typedef struct square_t {
     int rank, file;
 } square_t;
@@ -17,6 +21,10 @@ typedef struct square_t {
 #define MK_SQUARE(r, f)                                                        \
     (square_t) { .rank = r, .file = f }
 
+#define SQUARE_INDEX(s) ((s).rank * CHESS_WIDTH + (s).file)
+#define MK_SQUARE_INDEX(i) MK_SQUARE((i) / CHESS_WIDTH, (i) % CHESS_WIDTH)
+#define BB_SQUARE(i) (1ULL << (i))
+
 typedef struct move_t {
     square_t start;
     square_t end;
@@ -27,18 +35,71 @@ typedef struct move_t {
 #define MK_MOVE(s, e, m, p)                                                  \
     (move_t) { .start = s, .end = e, .move = m, .promotion = p }
 
+// Compact move used inside the engine, move_t is kept for the strategies and the GUI
+// bits 0-5: start square index, bits 6-11: end square index, bits 12-15: flags
+typedef unsigned short packed_move_t;
+
+#define PACKED_MOVE_NONE 0 // a1a1, never a valid move
+
+#define PACKED_MOVE_QUIET 0
+#define PACKED_MOVE_CASTLE_SHORT 1
+#define PACKED_MOVE_CASTLE_LONG 2
+#define PACKED_MOVE_CAPTURE 4
+#define PACKED_MOVE_ENPASSANT 5
+#define PACKED_MOVE_PROMOTE 8 // The low 2 bits index into CHESS_PROMOTE_OPTIONS
+
+#define MK_PACKED_MOVE(s, e, f) ((packed_move_t)((s) | ((e) << 6) | ((f) << 12)))
+#define PACKED_MOVE_START(m) ((m) & 0x3F)
+#define PACKED_MOVE_END(m) (((m) >> 6) & 0x3F)
+#define PACKED_MOVE_FLAGS(m) (((m) >> 12) & 0xF)
+
+#define CHESS_MAX_MOVES 256
+
+// Fixed capacity move list, large enough for the legal moves of any position
+typedef struct move_list_t {
+    packed_move_t moves[CHESS_MAX_MOVES];
+    int count;
+} move_list_t;
+
 typedef struct chess_state_t {
     chess_board_t board;
+    bitboard_t pieces[7]; // Occupancy for each piece type, indexed by CHESS_PAWN..CHESS_KING
+    bitboard_t colors[2]; // Occupancy for each color, indexed by COLOR_INDEX
+    int king_square[2]; // Square index of each king, indexed by COLOR_INDEX, -1 if missing
     int last_move; // 1 if we have a last move
     square_t last_move_start;
     square_t last_move_end;
-    char king_moved; // CHESS_WHITE if white moved CHESS_BLACK if black moved
-    char short_rook_moved;
-    char long_rook_moved;
+    char castling; // CHESS_CASTLING_* rights that are still available
+    int enpassant; // Square index behind a pawn that just moved two squares, -1 if none
+    zobrist_t hash; // Zobrist key of the pieces, side to move, castling rights and en passant file
 
     char current_player;
 } chess_state_t;
 
+// What chess_unmake_move needs to restore, besides the move itself
+typedef struct chess_undo_t {
+    char captured;
+    int last_move;
+    square_t last_move_start;
+    square_t last_move_end;
+    char castling;
+    int enpassant;
+    zobrist_t hash;
+} chess_undo_t;
+
+// Attack information of one position for the side to move, shared by generation,
+// legality and check tests. chess_attack_map_get only recomputes it when the map
+// was built for another position, so a zeroed map starts out empty
+typedef struct chess_attack_map_t {
+    zobrist_t hash; // Key of the position the map was built for
+    char player; // Side to move of that position, CHESS_NONE if empty
+    int king; // Square index of the king of the side to move
+    bitboard_t threats; // Squares attacked by the enemy, seen through our king
+    bitboard_t checkers; // Enemy pieces giving check
+    bitboard_t pinned; // Own pieces pinned to the king
+    bitboard_t check_mask; // Targets that resolve the check, all squares if not in check
+} chess_attack_map_t;
+
 unsigned long chess_state_size(void);
 unsigned long chess_move_size(void);
 
@@ -52,6 +113,12 @@ unsigned long chess_move_size(void);
 #define CHESS_CAPTURE 32
 #define CHESS_CHECK 64
 
+#define CHESS_CASTLING_WHITE_SHORT 1
+#define CHESS_CASTLING_WHITE_LONG 2
+#define CHESS_CASTLING_BLACK_SHORT 4
+#define CHESS_CASTLING_BLACK_LONG 8
+#define CHESS_CASTLING_ALL 15
+
 #define CHESS_PAWN 1
 #define CHESS_ROOK 2
 #define CHESS_KNIGHT 3
@@ -63,6 +130,7 @@ unsigned long chess_move_size(void);
 #define CHESS_WHITE 8
 #define CHESS_BLACK 16
 #define COLOR_FLAG 0b11000
+#define COLOR_INDEX(c) ((c) >> 4)
 
 #define EVAL_PAWN 100
 #define EVAL_KNIGHT 300
@@ -71,6 +139,11 @@ unsigned long chess_move_size(void);
 #define EVAL_QUEEN 900
 #define EVAL_KING 100
 
+// EVAL_* by piece type, so SEE and the move ordering weigh pieces the same
+extern const int chess_piece_values[7];
+// 1 for the least valuable piece up to 6 for the king, the order attackers recapture in
+extern const char chess_piece_ranks[7];
+
 #define SQUARE_DARK 0xA97C6D
 #define SQUARE_LIGHT 0xF4D3B2
 #define SQUARE_DARK_MOVE 0x794C3D
@@ -80,20 +153,60 @@ unsigned long chess_move_size(void);
 char chess_square_get(const chess_board_t *board, square_t square);
 void chess_square_set(chess_board_t *board, square_t square, char piece);
 boolean chess_move_get(const move_t *moves, int count, move_t filter, int *index);
+packed_move_t chess_move_pack(move_t move);
+move_t chess_move_unpack(packed_move_t move, char current);
 
 #define CHESS_START "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1 "
 
+// Builds the attack lookup tables, safe to call more than once
+void chess_init_tables(void);
 void chess_init_fen(chess_state_t *state, ds_string_slice fen);
 void chess_dump_fen(const chess_state_t *state, char **fen);
 void chess_apply_move(chess_state_t *state, move_t move);
+// Apply/revert a move and switch current_player, for searching a single mutable position
+void chess_make_move(chess_state_t *state, packed_move_t move, chess_undo_t *undo);
+void chess_unmake_move(chess_state_t *state, packed_move_t move, const chess_undo_t *undo);
 void chess_generate_moves(const chess_state_t *state, ds_dynamic_array *moves /* move_t */);
+void chess_generate_move_list(const chess_state_t *state, move_list_t *moves);
+// Split of chess_generate_move_list: captures and promotions, then the remaining quiet moves
+// The map must belong to state, see chess_attack_map_get
+void chess_generate_captures(const chess_state_t *state, const chess_attack_map_t *map, move_list_t *moves);
+void chess_generate_quiets(const chess_state_t *state, const chess_attack_map_t *map, move_list_t *moves);
+// The quiet moves that give check, for tactical searches that skip the other quiets
+void chess_generate_quiet_checks(const chess_state_t *state, const chess_attack_map_t *map, move_list_t *moves);
 char chess_flip_player(char current);
 
 // Functions to check if the game is over
+#define CHESS_STATUS_PLAYING 0
+#define CHESS_STATUS_CHECKMATE 1 // The side to move is mated
+#define CHESS_STATUS_STALEMATE 2
+
+// Checkmate and stalemate from a single legal move test, for callers that already hold the map
+int chess_status(const chess_state_t *state, const chess_attack_map_t *map);
 char chess_checkmate(const chess_state_t *state);
 int chess_draw(const chess_state_t *state);
 
 int chess_is_in_check(const chess_state_t *state, char current);
+void chess_attack_map_compute(const chess_state_t *state, chess_attack_map_t *map);
+const chess_attack_map_t *chess_attack_map_get(const chess_state_t *state, chess_attack_map_t *map);
+// Legal moves of many positions into one flat buffer: the moves of states[i] are
+// moves[offsets[i]] up to moves[offsets[i + 1]], so offsets needs count + 1 entries.
+// Returns how many positions fit in capacity moves, the caller resumes from there.
+// Only reads the states and the shared tables, so a batch can be split across threads
+int chess_generate_moves_batch(const chess_state_t *states, int count, packed_move_t *moves, int capacity, int *offsets);
+// Checks a single move for the side to move without generating the others; pseudo
+// legal moves follow the piece rules but may still leave the king in check
+boolean chess_is_pseudo_legal(const chess_state_t *state, packed_move_t move);
+boolean chess_is_legal(const chess_state_t *state, const chess_attack_map_t *map, packed_move_t move);
+// Whether a legal move of the side to move checks the enemy king, without playing it
+boolean chess_move_gives_check(const chess_state_t *state, packed_move_t move);
+// Static exchange evaluation: the material the side to move ends up with after
+// the move and the best sequence of recaptures on its target square, x-rays
+// included. Pins are not considered
+int chess_see(const chess_state_t *state, packed_move_t move);
+// Legal moves of the side to move, without building the move list
+int chess_count_legal_moves(const chess_state_t *state, const chess_attack_map_t *map);
+boolean chess_has_legal_move(const chess_state_t *state, const chess_attack_map_t *map);
 int chess_is_checkmate(const chess_state_t *state, char current);
 int chess_is_stalemate(const chess_state_t *state, char current);
 int chess_is_draw(const chess_state_t *state, char current);
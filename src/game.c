@@ -16,7 +16,6 @@ static void chess_print_board() {
     int cell_width = SCREEN_WIDTH / CHESS_WIDTH;
     int cell_height = SCREEN_HEIGHT / CHESS_HEIGHT;
 
-    square_t king_square = {0};
     for (unsigned int file = 0; file < CHESS_WIDTH; file++) {
         for (unsigned int rank = 0; rank < CHESS_HEIGHT; rank++) {
             int is_light_square = (file + rank) % 2 == 1;
@@ -30,18 +29,11 @@ static void chess_print_board() {
             int rank_px = (CHESS_WIDTH - rank - 1) * cell_height;
 
             DrawRectangle(file_px, rank_px, cell_width, cell_height, color);
-
-            square_t square = (square_t){.rank = rank, .file = file};
-            char piece = chess_square_get(&state.board, square);
-            char piece_color = piece & COLOR_FLAG;
-            char piece_type = piece & PIECE_FLAG;
-            if (piece_color == state.current_player && piece_type == CHESS_KING) {
-                king_square = square;
-            }
         }
     }
 
     if (is_in_check) {
+        square_t king_square = MK_SQUARE_INDEX(state.king_square[COLOR_INDEX(state.current_player)]);
         int file = king_square.file;
         int rank = king_square.rank;
 
@@ -181,7 +173,8 @@ void tick(float deltaTime) {
         if (index != -1) {
             move_t *move = NULL;
             ds_dynamic_array_get_ref(&moves, index, (void **)&move);
-            chess_apply_move(&state, *move);
+            chess_undo_t undo = {0};
+            chess_make_move(&state, chess_move_pack(*move), &undo);
 
             if (move->move == CHESS_MOVE) {
                 PlaySound(LoadSoundCachedMove(CHESS_MOVE));
@@ -195,8 +188,6 @@ void tick(float deltaTime) {
             ClearBackground(RAYWHITE);
             chess_print_board();
 
-            state.current_player = chess_flip_player(state.current_player);
-
             is_in_check = chess_is_in_check(&state, state.current_player);
 
             chess_generate_moves(&state, &moves);
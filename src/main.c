@@ -2,12 +2,14 @@
 #include "raylib.h"
 #include "chess.h"
 #include "game.h"
+#include "util.h"
 #include "ds.h"
 #include <dlfcn.h>
 
 #define SUBCMD_GAME "game"
 #define SUBCMD_COUNT_POSITIONS "count-positions"
 #define SUBCMD_MOVE "move"
+#define SUBCMD_TEST "test"
 
 typedef struct arguments_t {
     char *subcmd;
@@ -40,7 +42,7 @@ void parse_arguments(int argc, char **argv, arguments_t *args) {
     ds_argparse_add_argument(&parser, (ds_argparse_options){
         .short_name = 's',
         .long_name = "subcmd",
-        .description = "The subcommand to use with the engine: `game`, `count-positions`, `move`. Default: `game`",
+        .description = "The subcommand to use with the engine: `game`, `count-positions`, `move`, `test`. Default: `game`",
         .type = ARGUMENT_TYPE_POSITIONAL,
         .required = false,
     });
@@ -179,6 +181,62 @@ int move(arguments_t args) {
     return 0;
 }
 
+// Exchanges with a known outcome; a capture search keeps a move only if it does not lose material
+typedef struct see_test_t {
+    char *fen;
+    packed_move_t move;
+    int see;
+} see_test_t;
+
+static see_test_t see_tests[] = {
+    // Re1xe5, the pawn is not defended
+    {"1k1r4/1pp4p/p7/4p3/8/P5P1/1PP4P/2K1R3 w - - 0 1", MK_PACKED_MOVE(4, 36, PACKED_MOVE_CAPTURE), EVAL_PAWN},
+    // Nd3xe5, black has more pieces behind the recapture
+    {"1k1r3q/1ppn3p/p4b2/4p3/8/P2N2P1/1PP1R1BP/2K1Q3 w - - 0 1", MK_PACKED_MOVE(19, 36, PACKED_MOVE_CAPTURE), EVAL_PAWN - EVAL_KNIGHT},
+    // Rd2xd5, the rook behind on d1 joins in and black should not recapture
+    {"3q2k1/8/8/3p4/8/8/3R4/3R2K1 w - - 0 1", MK_PACKED_MOVE(11, 35, PACKED_MOVE_CAPTURE), EVAL_PAWN},
+    // a7a8=Q, the rook on b8 takes the new queen
+    {"1r5k/P7/8/8/8/8/8/4K3 w - - 0 1", MK_PACKED_MOVE(48, 56, PACKED_MOVE_PROMOTE), -EVAL_PAWN},
+};
+
+int test(arguments_t args) {
+    UNUSED(args);
+
+    int failed = 0;
+    for (unsigned long i = 0; i < sizeof(see_tests) / sizeof(see_tests[0]); i++) {
+        see_test_t *t = &see_tests[i];
+
+        chess_state_t state = {0};
+        chess_init_fen(&state, DS_STRING_SLICE(t->fen));
+
+        int see = chess_see(&state, t->move);
+        if (see != t->see) {
+            DS_LOG_ERROR("SEE of move %d in %s: expected %d, got %d", t->move, t->fen, t->see, see);
+            failed += 1;
+        }
+
+        chess_attack_map_t map = {0};
+        chess_attack_map_get(&state, &map);
+
+        boolean kept = false;
+        move_picker picker = {0};
+        move_picker_init_captures(&picker, &state, &map);
+        packed_move_t move = PACKED_MOVE_NONE;
+        while (move_picker_next(&picker, &move)) {
+            if (move == t->move) kept = true;
+        }
+
+        if (kept != (t->see >= 0)) {
+            DS_LOG_ERROR("Capture search %s move %d in %s", kept ? "keeps" : "drops", t->move, t->fen);
+            failed += 1;
+        }
+    }
+
+    DS_LOG_INFO("SEE tests: %d failed", failed);
+
+    return failed != 0;
+}
+
 int main(int argc, char **argv) {
     arguments_t args = {0};
     parse_arguments(argc, argv, &args);
@@ -189,6 +247,8 @@ int main(int argc, char **argv) {
         return count_positions(args);
     } else if (DS_STRCMP(args.subcmd, SUBCMD_MOVE) == 0) {
         return move(args);
+    } else if (DS_STRCMP(args.subcmd, SUBCMD_TEST) == 0) {
+        return test(args);
     }
 
     return 1;
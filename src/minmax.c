@@ -7,10 +7,20 @@
 #include "chess.h"
 #include "util.h"
 
-#ifndef MINMAX_DEPTH
-#define MINMAX_DEPTH 4
+// Time budget for one move in milliseconds
+#ifndef MINMAX_TIME
+#define MINMAX_TIME 1000
 #endif
 
+// The transposition table holds 2^MINMAX_TABLE_BITS entries
+#ifndef MINMAX_TABLE_BITS
+#define MINMAX_TABLE_BITS 18
+#endif
+
+// Kept between moves, the positions of the last search are often reached again
+static transposition_entry entries[1UL << MINMAX_TABLE_BITS];
+static transposition_table table = {0};
+
 static int eval(const chess_state_t *state, char current) {
     int material1 = chess_count_material_weighted(state, current);
     int material2 = chess_count_material_weighted(state, chess_flip_player(current));
@@ -18,18 +28,9 @@ static int eval(const chess_state_t *state, char current) {
     return material1 - material2;
 }
 
-static int sort(const void *a, const void *b) {
-    move_t *move_a = (move_t *)a;
-    move_t *move_b = (move_t *)b;
-
-    if ((move_a->move & CHESS_CAPTURE) != 0) return -1;
-    if ((move_b->move & CHESS_CAPTURE) != 0) return 1;
-
-    return 0;
-}
-
 void chess_init(void *memory, unsigned long size) {
     util_init(memory, size);
+    transposition_init(&table, entries, 1UL << MINMAX_TABLE_BITS);
 
 #ifdef __wasm__
 #else
@@ -39,18 +40,55 @@ void chess_init(void *memory, unsigned long size) {
 
 void chess_move(const chess_state_t *state, move_t *choices, int count, int *index) {
     minmax_info info = {0};
+    info.table = &table;
+    transposition_new_search(&table);
+
+    chess_state_t position = {0};
+    DS_MEMCPY(&position, state, sizeof(chess_state_t));
+
+    long long start = util_time_ms();
+
+    // Iterative deepening: each iteration starts from the best move of the
+    // previous one and the killers it left behind, and only completed
+    // iterations are trusted
+    move_score s = MK_MOVE_SCORE(PACKED_MOVE_NONE, 0);
+    int depth = 0;
+    for (int next = 1; next < MINMAX_MAX_DEPTH; next++) {
+        info.root_depth = next;
+        info.root_move = s.move;
+
+        move_score result = minmax(&position, position.current_player, next,
+                                   -MINMAX_INF, MINMAX_INF, eval, &info);
+        if (info.aborted) break;
+
+        s = result;
+        depth = next;
+
+        // A forced mate is not going to change with more depth
+        if (s.score == MINMAX_INF || s.score == -MINMAX_INF) break;
 
-    clock_t start = clock();
+        // The next iteration costs several times this one, so it would not finish
+        long long elapsed = util_time_ms() - start;
+        if (elapsed * 2 >= MINMAX_TIME) break;
 
-    move_score s = minmax(state, choices, count, state->current_player, MINMAX_DEPTH,
-                          -MINMAX_INF, MINMAX_INF, eval, sort, &info);
+        // The first iteration always completes so there is a move to play
+        info.deadline = start + MINMAX_TIME;
+    }
 
-    clock_t end = clock();
+    long long end = util_time_ms();
 
-    DS_LOG_DEBUG("Minmax took %f seconds", (double)(end - start) / CLOCKS_PER_SEC);
+    DS_LOG_DEBUG("Minmax took %f seconds", (double)(end - start) / 1000);
+    DS_LOG_DEBUG("Searched to depth %d", depth);
     DS_LOG_DEBUG("Evaluated %d positions", info.positions);
+    DS_LOG_DEBUG("Quiescence positions: %d", info.quiescence_positions);
+    DS_LOG_DEBUG("Transposition table hits: %d", info.table_hits);
     DS_LOG_DEBUG("Evaluation: %d", s.score);
 
-    *index = s.move;
+    *index = -1;
+    for (int i = 0; i < count; i++) {
+        if (chess_move_pack(choices[i]) == s.move) {
+            *index = i;
+        }
+    }
 }
 
@@ -412,7 +412,7 @@ export class RaylibJS implements WasmModule {
     }
 
     clock(): number {
-        return Date.now();
+        return Math.floor(performance.now());
     }
 
     dumpCString(
@@ -1,3 +1,9 @@
+// clock_gettime is POSIX, not part of C11
+#ifndef __wasm__
+#define _POSIX_C_SOURCE 199309L
+#include <time.h>
+#endif
+
 #include "util.h"
 
 DS_ALLOCATOR allocator = {0};
@@ -147,6 +153,8 @@ int px_to_option(Vector2 *px) {
 
 void util_init(void *memory, unsigned long size) {
     DS_INIT_ALLOCATOR(&allocator, memory, size);
+
+    chess_init_tables();
 }
 
 void *util_malloc(unsigned long size) {
@@ -157,66 +165,422 @@ void util_free(void *ptr) {
     DS_FREE(&allocator, ptr);
 }
 
-move_score minmax(const chess_state_t *state, move_t *choices, int count,
-                  char maxxing, int depth, int alpha, int beta, eval_fn *eval,
-                  sort_fn *sort, minmax_info *info) {
-    char result = chess_checkmate(state);
-    if (result != CHESS_NONE) {
+long long util_time_ms(void) {
+#ifdef __wasm__
+    // The shim in raylib.ts reads performance.now()
+    return (long long)clock() * 1000 / CLOCKS_PER_SEC;
+#else
+    // clock() would only count the CPU time of this process
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+#define MOVE_PICKER_HASH 0
+#define MOVE_PICKER_GENERATE_CAPTURES 1
+#define MOVE_PICKER_CAPTURES 2
+#define MOVE_PICKER_KILLERS 3
+#define MOVE_PICKER_QUIETS 4
+#define MOVE_PICKER_BAD_CAPTURES 5
+#define MOVE_PICKER_DONE 6
+
+// Pushes a losing capture below every winning one, scores stay negative
+#define MOVE_PICKER_LOSING -128
+
+void move_picker_init(move_picker *picker, const chess_state_t *state, const chess_attack_map_t *map,
+                      packed_move_t hash_move, const packed_move_t *killers) {
+    picker->state = state;
+    picker->map = map;
+    picker->hash_move = hash_move;
+    picker->killers[0] = (killers != NULL) ? killers[0] : PACKED_MOVE_NONE;
+    picker->killers[1] = (killers != NULL) ? killers[1] : PACKED_MOVE_NONE;
+    picker->killer = 0;
+    picker->captures_only = false;
+    picker->stage = MOVE_PICKER_HASH;
+    picker->index = 0;
+    picker->bad = 0;
+    picker->quiets = 0;
+    picker->moves.count = 0;
+}
+
+void move_picker_init_captures(move_picker *picker, const chess_state_t *state, const chess_attack_map_t *map) {
+    move_picker_init(picker, state, map, PACKED_MOVE_NONE, NULL);
+    picker->captures_only = true;
+}
+
+static boolean move_picker_is_killer(const move_picker *picker, packed_move_t move) {
+    return move == picker->killers[0] || move == picker->killers[1];
+}
+
+// MVV-LVA for a capture or promotion. The exchange is only worked out when the
+// piece left on the square, the new piece for a promotion, is worth more than
+// what the move wins: otherwise even losing that piece keeps the balance even
+static short move_picker_score(const move_picker *picker, packed_move_t move) {
+    const chess_state_t *state = picker->state;
+    int flags = PACKED_MOVE_FLAGS(move);
+    int end = PACKED_MOVE_END(move);
+    char attacker = state->board[PACKED_MOVE_START(move)] & PIECE_FLAG;
+    char moved = attacker;
+
+    char victim = CHESS_NONE;
+    if (flags == PACKED_MOVE_ENPASSANT) victim = CHESS_PAWN;
+    else if ((flags & PACKED_MOVE_CAPTURE) != 0) victim = state->board[end] & PIECE_FLAG;
+
+    int score = 8 * chess_piece_ranks[(int)victim] - chess_piece_ranks[(int)attacker];
+    int gain = chess_piece_values[(int)victim];
+    if ((flags & PACKED_MOVE_PROMOTE) != 0) {
+        char promoted = CHESS_PROMOTE_OPTIONS[flags & 3];
+        score += 8 * chess_piece_ranks[(int)promoted];
+        gain += chess_piece_values[(int)promoted] - EVAL_PAWN;
+        moved = promoted;
+    }
+
+    if (chess_piece_values[(int)moved] > gain && chess_see(state, move) < 0) {
+        score += MOVE_PICKER_LOSING;
+    }
+
+    return score;
+}
+
+// Selection sort one step at a time, most nodes never look past the first moves.
+// With winning set it stops at the first losing capture
+static boolean move_picker_select(move_picker *picker, int end, boolean winning, packed_move_t *move) {
+    packed_move_t *moves = picker->moves.moves;
+    short *scores = picker->scores;
+
+    while (picker->index < end) {
+        int best = picker->index;
+        for (int i = picker->index + 1; i < end; i++) {
+            if (scores[i] > scores[best]) best = i;
+        }
+
+        if (winning && scores[best] < 0) return false;
+
+        packed_move_t selected = moves[best];
+        short score = scores[best];
+        moves[best] = moves[picker->index];
+        scores[best] = scores[picker->index];
+        moves[picker->index] = selected;
+        scores[picker->index] = score;
+        picker->index += 1;
+
+        if (selected == picker->hash_move) continue;
+
+        *move = selected;
+        return true;
+    }
+
+    return false;
+}
+
+boolean move_picker_next(move_picker *picker, packed_move_t *move) {
+    switch (picker->stage) {
+        case MOVE_PICKER_HASH:
+            picker->stage = MOVE_PICKER_GENERATE_CAPTURES;
+            if (picker->hash_move != PACKED_MOVE_NONE) {
+                *move = picker->hash_move;
+                return true;
+            }
+            // fallthrough
+        case MOVE_PICKER_GENERATE_CAPTURES:
+            chess_generate_captures(picker->state, picker->map, &picker->moves);
+            for (int i = 0; i < picker->moves.count; i++) {
+                picker->scores[i] = move_picker_score(picker, picker->moves.moves[i]);
+            }
+            picker->index = 0;
+            picker->stage = MOVE_PICKER_CAPTURES;
+            // fallthrough
+        case MOVE_PICKER_CAPTURES:
+            if (move_picker_select(picker, picker->moves.count, true, move)) return true;
+
+            // The losing captures are left over, the quiet moves go after them
+            picker->bad = picker->index;
+            picker->quiets = picker->moves.count;
+            if (picker->captures_only) {
+                picker->stage = MOVE_PICKER_DONE;
+                return false;
+            }
+
+            // Killers are only trusted if they are legal quiet moves here
+            move_list_t quiets = {0};
+            chess_generate_quiets(picker->state, picker->map, &quiets);
+            DS_MEMCPY(&picker->moves.moves[picker->quiets], quiets.moves, quiets.count * sizeof(packed_move_t));
+            picker->moves.count += quiets.count;
+            picker->index = picker->quiets;
+            picker->stage = MOVE_PICKER_KILLERS;
+            // fallthrough
+        case MOVE_PICKER_KILLERS:
+            while (picker->killer < 2) {
+                packed_move_t killer = picker->killers[picker->killer++];
+                if (killer == PACKED_MOVE_NONE || killer == picker->hash_move) continue;
+
+                for (int i = picker->quiets; i < picker->moves.count; i++) {
+                    if (picker->moves.moves[i] == killer) {
+                        *move = killer;
+                        return true;
+                    }
+                }
+            }
+            picker->stage = MOVE_PICKER_QUIETS;
+            // fallthrough
+        case MOVE_PICKER_QUIETS:
+            // Quiet moves have no order of their own, they come in generation order
+            while (picker->index < picker->moves.count) {
+                packed_move_t selected = picker->moves.moves[picker->index++];
+                if (selected == picker->hash_move || move_picker_is_killer(picker, selected)) continue;
+
+                *move = selected;
+                return true;
+            }
+            picker->index = picker->bad;
+            picker->stage = MOVE_PICKER_BAD_CAPTURES;
+            // fallthrough
+        case MOVE_PICKER_BAD_CAPTURES:
+            if (move_picker_select(picker, picker->quiets, false, move)) return true;
+            picker->stage = MOVE_PICKER_DONE;
+            // fallthrough
+        default:
+            return false;
+    }
+}
+
+void transposition_init(transposition_table *table, transposition_entry *entries, unsigned long count) {
+    if (count == 0 || (count & (count - 1)) != 0) {
+        DS_PANIC("Transposition table size must be a power of two %lu", count);
+    }
+
+    DS_MEMSET(entries, 0, count * sizeof(transposition_entry));
+    table->entries = entries;
+    table->mask = count - 1;
+    table->age = 0;
+}
+
+void transposition_new_search(transposition_table *table) {
+    table->age = (table->age + 1) & 0x3F;
+}
+
+transposition_entry *transposition_probe(transposition_table *table, zobrist_t key) {
+    transposition_entry *entry = &table->entries[key & table->mask];
+    if (entry->key != key) {
+        return NULL;
+    }
+
+    return entry;
+}
+
+void transposition_store(transposition_table *table, zobrist_t key, packed_move_t move,
+                         int score, int depth, int bound) {
+    transposition_entry *entry = &table->entries[key & table->mask];
+
+    // Deeper results are worth more, unless they are left over from an older search
+    if (entry->key != key && entry->age == table->age && entry->depth > depth) {
+        return;
+    }
+
+    // A shallower pass over the same position keeps the move it already knew
+    if (entry->key == key && move == PACKED_MOVE_NONE) {
+        move = entry->move;
+    }
+
+    entry->key = key;
+    entry->score = score;
+    entry->move = move;
+    entry->depth = depth;
+    entry->bound = bound;
+    entry->age = table->age;
+}
+
+// Reading the time is slow compared to a node, so it is only polled now and then
+#define MINMAX_POLL_NODES 1024
+
+static boolean minmax_out_of_time(minmax_info *info) {
+    if (info->deadline != 0 && info->nodes % MINMAX_POLL_NODES == 0 && util_time_ms() >= info->deadline) {
+        info->aborted = true;
+    }
+
+    return info->aborted;
+}
+
+// Resolves the captures left hanging at a leaf, the side to move may stand pat
+// on the static eval instead of capturing. In check every evasion is searched
+static int minmax_quiescence(chess_state_t *state, char maxxing, int depth, int alpha,
+                             int beta, eval_fn *eval, minmax_info *info) {
+    info->nodes += 1;
+    info->quiescence_positions += 1;
+    if (minmax_out_of_time(info)) {
+        return 0;
+    }
+
+    if (depth == 0) {
+        return eval(state, maxxing);
+    }
+
+    // Quiescence plies carry on from the leaf, which sits at root_depth
+    int ply = info->root_depth + MINMAX_QUIESCENCE_DEPTH - depth;
+    const chess_attack_map_t *map = chess_attack_map_get(state, &info->maps[ply]);
+
+    char current = state->current_player;
+    int in_check = map->checkers != 0;
+
+    int best = 0;
+    if (in_check) {
+        best = (maxxing == current) ? -MINMAX_INF : MINMAX_INF;
+    } else {
+        best = eval(state, maxxing);
+        if (maxxing == current) {
+            if (best > alpha) alpha = best;
+        } else {
+            if (best < beta) beta = best;
+        }
+
+        if (alpha > beta) return best;
+    }
+
+    move_picker picker = {0};
+    if (in_check) move_picker_init(&picker, state, map, PACKED_MOVE_NONE, NULL);
+    else move_picker_init_captures(&picker, state, map);
+
+    packed_move_t move = PACKED_MOVE_NONE;
+    while (move_picker_next(&picker, &move)) {
+        chess_undo_t undo = {0};
+        chess_make_move(state, move, &undo);
+
+        int value = minmax_quiescence(state, maxxing, depth - 1, alpha, beta, eval, info);
+
+        chess_unmake_move(state, move, &undo);
+
+        if (info->aborted) break;
+
+        if (maxxing == current) {
+            if (value > best) best = value;
+            if (value > alpha) alpha = value;
+        } else {
+            if (value < best) best = value;
+            if (value < beta) beta = value;
+        }
+
+        if (alpha > beta) break;
+    }
+
+    // In check without an evasion best is still the mate score
+    return best;
+}
+
+move_score minmax(chess_state_t *state, char maxxing, int depth, int alpha,
+                  int beta, eval_fn *eval, minmax_info *info) {
+    info->nodes += 1;
+    if (minmax_out_of_time(info)) {
+        return MK_MOVE_SCORE(PACKED_MOVE_NONE, 0);
+    }
+
+    // Keyed by ply, so the next iteration finds them at the same distance from the root
+    int ply = info->root_depth - depth;
+    const chess_attack_map_t *map = chess_attack_map_get(state, &info->maps[ply]);
+    char current = state->current_player;
+
+    int status = chess_status(state, map);
+    if (status == CHESS_STATUS_CHECKMATE) {
         info->positions += 1;
-        return MK_MOVE_SCORE(-1, (maxxing == result) ? -MINMAX_INF : MINMAX_INF);
+        return MK_MOVE_SCORE(PACKED_MOVE_NONE, (maxxing == current) ? -MINMAX_INF : MINMAX_INF);
     }
 
-    if (chess_draw(state)) {
+    if (status == CHESS_STATUS_STALEMATE) {
         info->positions += 1;
-        return MK_MOVE_SCORE(-1, 0);
+        return MK_MOVE_SCORE(PACKED_MOVE_NONE, 0);
     }
 
     if (depth == 0) {
         info->positions += 1;
-        return MK_MOVE_SCORE(-1, eval(state, maxxing));
+        int score = minmax_quiescence(state, maxxing, MINMAX_QUIESCENCE_DEPTH, alpha, beta, eval, info);
+        return MK_MOVE_SCORE(PACKED_MOVE_NONE, score);
     }
 
-    move_score best = {.score = 0, .move = -1};
-    if (maxxing == state->current_player) best.score = -MINMAX_INF;
+    // The table works from the side to move, so the window is flipped for the minimizing side
+    int sign = (maxxing == current) ? 1 : -1;
+    int low = (sign > 0) ? alpha : -beta;
+    int high = (sign > 0) ? beta : -alpha;
+
+    packed_move_t hash_move = PACKED_MOVE_NONE;
+    transposition_entry *entry = NULL;
+    if (info->table != NULL) entry = transposition_probe(info->table, state->hash);
+
+    if (entry != NULL) {
+        // The root has to come back with a move, so it is always searched
+        if (entry->depth >= depth && depth != info->root_depth) {
+            int is_exact = entry->bound == MINMAX_BOUND_EXACT;
+            int is_high = entry->bound == MINMAX_BOUND_LOWER && entry->score >= high;
+            int is_low = entry->bound == MINMAX_BOUND_UPPER && entry->score <= low;
+            if (is_exact || is_high || is_low) {
+                info->table_hits += 1;
+                return MK_MOVE_SCORE(entry->move, sign * entry->score);
+            }
+        }
+
+        // Another position can share the key, so the move is checked before it is played
+        if (entry->move != PACKED_MOVE_NONE && chess_is_legal(state, map, entry->move)) {
+            hash_move = entry->move;
+        }
+    }
+
+    if (depth == info->root_depth && info->root_move != PACKED_MOVE_NONE) hash_move = info->root_move;
+
+    move_score best = {.score = 0, .move = PACKED_MOVE_NONE};
+    if (maxxing == current) best.score = -MINMAX_INF;
     else best.score = MINMAX_INF;
-    best.move = (count == 0) ? -1 : rand() % count;
 
-    ds_dynamic_array moves = {0}; /* move_t */
-    ds_dynamic_array_init_allocator(&moves, sizeof(move_t), &allocator);
-    for (int i = 0; i < count; i++) {
-        chess_state_t clone = {0};
-        DS_MEMCPY(&clone, state, sizeof(chess_state_t));
+    move_picker picker = {0};
+    move_picker_init(&picker, state, map, hash_move, info->killers[ply]);
+
+    packed_move_t move = PACKED_MOVE_NONE;
+    while (move_picker_next(&picker, &move)) {
+        if (best.move == PACKED_MOVE_NONE) best.move = move;
 
-        move_t move = choices[i];
-        chess_apply_move(&clone, move);
+        chess_undo_t undo = {0};
+        chess_make_move(state, move, &undo);
 
-        clone.current_player = chess_flip_player(clone.current_player);
+        move_score value = minmax(state, maxxing, depth - 1, alpha, beta, eval, info);
 
-        chess_generate_moves(&clone, &moves);
-        if (sort != NULL) ds_dynamic_array_sort(&moves, sort);
+        chess_unmake_move(state, move, &undo);
 
-        move_score value = minmax(&clone, moves.items, moves.count, maxxing, depth - 1, alpha, beta, eval, sort, info);
+        if (info->aborted) break;
 
-        if (maxxing == state->current_player) {
+        if (maxxing == current) {
             if (value.score > best.score) {
                 best.score = value.score;
-                best.move = i;
+                best.move = move;
             }
 
             if (value.score > alpha) alpha = value.score;
         } else {
             if (value.score < best.score) {
                 best.score = value.score;
-                best.move = i;
+                best.move = move;
             }
 
             if (value.score < beta) beta = value.score;
         }
 
-        if (alpha > beta) break;
+        if (alpha > beta) {
+            int is_quiet = (PACKED_MOVE_FLAGS(move) & (PACKED_MOVE_CAPTURE | PACKED_MOVE_PROMOTE)) == 0;
+            if (is_quiet && info->killers[ply][0] != move) {
+                info->killers[ply][1] = info->killers[ply][0];
+                info->killers[ply][0] = move;
+            }
+
+            break;
+        }
     }
 
-    ds_dynamic_array_free(&moves);
+    if (info->table != NULL && !info->aborted) {
+        int score = sign * best.score;
+
+        int bound = MINMAX_BOUND_EXACT;
+        if (score <= low) bound = MINMAX_BOUND_UPPER;
+        else if (score >= high) bound = MINMAX_BOUND_LOWER;
+
+        transposition_store(info->table, state->hash, best.move, score, depth, bound);
+    }
 
     return best;
 }
@@ -22,20 +22,70 @@
 #define MAX_CAPACITY 100
 
 #define MINMAX_INF 1000000
+#define MINMAX_MAX_DEPTH 64
+#define MINMAX_QUIESCENCE_DEPTH 8 // Captures searched past the nominal depth
 
 typedef struct move_score {
-    int move;
+    packed_move_t move;
     int score;
 } move_score;
 
+#define MINMAX_BOUND_EXACT 0
+#define MINMAX_BOUND_LOWER 1 // The search failed high, the score is at least this
+#define MINMAX_BOUND_UPPER 2 // The search failed low, the score is at most this
+
+// A searched position, scores are from the point of view of the side to move
+// so that they stay valid whichever side started the search
+typedef struct transposition_entry {
+    zobrist_t key;
+    int score;
+    packed_move_t move; // Best move found, PACKED_MOVE_NONE if none
+    unsigned char depth;
+    unsigned char bound : 2;
+    unsigned char age : 6; // The search that wrote the entry
+} transposition_entry;
+
+// Fixed size hash table of searched positions, indexed by the low bits of the key
+typedef struct transposition_table {
+    transposition_entry *entries;
+    unsigned long mask; // Entry count minus one, the count is a power of two
+    unsigned char age;
+} transposition_table;
+
 typedef struct minmax_info {
     int positions;
+    int quiescence_positions; // Nodes of the capture search below the leaves
+    int nodes; // Every node visited, positions only counts the leaves
+    packed_move_t killers[MINMAX_MAX_DEPTH][2]; // Quiet moves that caused a cutoff, by ply from the root
+    int root_depth; // The depth minmax is called with at the root, plies count down from it
+    chess_attack_map_t maps[MINMAX_MAX_DEPTH + MINMAX_QUIESCENCE_DEPTH + 1]; // By ply, reused when the same position comes back
+    packed_move_t root_move; // Best move of the previous iteration, searched first at the root
+    long long deadline; // The search gives up once util_time_ms() passes it, 0 for no limit
+    boolean aborted; // Set when the deadline was hit, the result is then unusable
+    transposition_table *table; // NULL to search without one
+    int table_hits; // Nodes answered by the table without searching
 } minmax_info;
 
 #define MK_MOVE_SCORE(m, s) (move_score){ .move = (m), .score = (s)}
 
 typedef int(eval_fn)(const chess_state_t *, char);
-typedef int (sort_fn)(const void *, const void *);
+// Hands out the moves of a position in stages: hash move, winning captures,
+// killers, quiet moves and losing captures, generating each stage only when
+// the previous one is used up
+typedef struct move_picker {
+    const chess_state_t *state;
+    const chess_attack_map_t *map; // Attack map of state, must outlive the picker
+    packed_move_t hash_move; // Must be legal in state, or PACKED_MOVE_NONE
+    packed_move_t killers[2];
+    int killer;
+    boolean captures_only; // Stop after the captures and promotions that do not lose material
+    int stage;
+    int index;
+    int bad; // First losing capture, they wait until the quiet moves are done
+    int quiets; // First quiet move, they are stored after the captures
+    move_list_t moves;
+    short scores[CHESS_MAX_MOVES]; // Capture order, short keeps the picker small on the stack
+} move_picker;
 
 Texture2D LoadTextureCachedPiece(char piece);
 Sound LoadSoundCachedMove(char move);
@@ -50,9 +100,24 @@ int long_compare(const void *k1, const void *k2);
 void util_init(void *memory, unsigned long size);
 void *util_malloc(unsigned long size);
 void util_free(void *ptr);
-
-move_score minmax(const chess_state_t *state, move_t *choices, int count,
-                  char maxxing, int depth, int alpha, int beta, eval_fn *eval,
-                  sort_fn *sort, minmax_info *info);
+// Wall-clock milliseconds from an arbitrary start, never going backwards
+long long util_time_ms(void);
+
+void transposition_init(transposition_table *table, transposition_entry *entries, unsigned long count);
+// Entries of older searches become the first to be replaced
+void transposition_new_search(transposition_table *table);
+transposition_entry *transposition_probe(transposition_table *table, zobrist_t key);
+void transposition_store(transposition_table *table, zobrist_t key, packed_move_t move,
+                         int score, int depth, int bound);
+
+void move_picker_init(move_picker *picker, const chess_state_t *state, const chess_attack_map_t *map,
+                      packed_move_t hash_move, const packed_move_t *killers);
+// Only captures and promotions that do not lose material, for the quiescence search
+void move_picker_init_captures(move_picker *picker, const chess_state_t *state, const chess_attack_map_t *map);
+boolean move_picker_next(move_picker *picker, packed_move_t *move);
+
+// The state is played on in place and is restored before returning
+move_score minmax(chess_state_t *state, char maxxing, int depth, int alpha,
+                  int beta, eval_fn *eval, minmax_info *info);
 
 #endif // UTIL_H
@@ -101,7 +101,8 @@ extern int rand();
 
 typedef int clock_t;
 
-#define CLOCKS_PER_SEC  ((clock_t) 1000000)
+// Milliseconds since the page loaded, see clock in raylib.ts
+#define CLOCKS_PER_SEC  ((clock_t) 1000)
 
 extern clock_t clock(void);
 